@@ -0,0 +1,250 @@
+/**
+ * @file
+ * Animated BPG playback with background frame prefetch
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <string.h>
+#include <exception>
+
+#include "animation.hpp"
+#include "log.h"
+
+using namespace std;
+using namespace bpg;
+using namespace winthread;
+
+
+AnimReader::AnimReader (ThreadPool &pool, int depth):
+    pool(pool),
+    dstFmt(AV_PIX_FMT_NONE), quality(-1), loopsLeft(0), bFirst(false),
+    curPic(NULL),
+    bRunning(false), bEos(true), bStop(false)
+{
+    if (depth < 2)
+        depth = 2;
+
+    pics = unique_ptr<Picture[]> (new Picture[depth]);
+    for (int i = 0; i < depth; i++)
+        freePics.push_back (&pics[i]);
+}
+
+
+AnimReader::~AnimReader()
+{
+    stop();
+}
+
+
+/**
+ * Stop prefetching and wait until producer task exits
+ */
+void AnimReader::stop()
+{
+    lock_guard _l(mtx);
+
+    bStop = true;
+    while (bRunning)
+        cv.wait (mtx);
+}
+
+
+/**
+ * Open an animation
+ * @param loops Number of loops to play; 0: follow the file; #LOOP_ONCE: once
+ */
+void AnimReader::Open (
+    const void *buf, size_t len,
+    enum AVPixelFormat dst_fmt,
+    int quality,
+    int loops
+)
+{
+    stop();
+
+    data.assign ((const uint8_t*)buf, (const uint8_t*)buf + len);
+    if (!dec)
+        dec = AcquireDecoder();
+    dec->DecodeBuffer (&data[0], len);
+    info = dec->GetInfo();
+
+    dstFmt = dst_fmt;
+    this->quality = quality;
+
+    if (loops == LOOP_ONCE || !info.has_animation)
+        loopsLeft = 1;
+    else if (loops > 0)
+        loopsLeft = loops;
+    else
+        loopsLeft = info.loop_count;
+
+    /* Recycle all buffers */
+    if (curPic)
+        freePics.push_back (curPic);
+    curPic = NULL;
+
+    while (!readyPics.empty())
+    {
+        freePics.push_back (readyPics.front());
+        readyPics.pop();
+    }
+
+    bFirst = true;
+    bEos = false;
+    bStop = false;
+    err = nullptr;
+    kick();
+}
+
+
+/**
+ * Move decoder to the next frame, restart if a loop ends
+ * @return false if end of animation
+ */
+bool AnimReader::nextFrame()
+{
+    if (bFirst)
+    {
+        bFirst = false;
+        return true;
+    }
+
+    if (dec->NextFrame())
+        return true;
+
+    /* End of a loop */
+    if (loopsLeft == 1)
+        return false;
+
+    if (loopsLeft > 1)
+        loopsLeft--;
+
+    /* Decoder buffers are reused */
+    dec->DecodeBuffer (&data[0], data.size());
+    return true;
+}
+
+
+/**
+ * Start producer task if there are free buffers
+ */
+void AnimReader::kick()
+{
+    {
+        lock_guard _l(mtx);
+
+        if (bRunning || bEos || bStop || freePics.empty())
+            return;
+
+        bRunning = true;
+    }
+
+    pool.EnqueueTask (bind (&AnimReader::produce, this));
+}
+
+
+/**
+ * Producer: decode & convert frames until buffers are full
+ */
+void AnimReader::produce()
+{
+    while (1)
+    {
+        Picture *pic;
+
+        {
+            lock_guard _l(mtx);
+
+            if (bStop || bEos || freePics.empty())
+            {
+                bRunning = false;
+                cv.notify_all();
+                return;
+            }
+
+            pic = freePics.back();
+            freePics.pop_back();
+        }
+
+        bool ok = false;
+        exception_ptr e_ptr;
+
+        try {
+            if (nextFrame())
+            {
+                if (!pic->frame)
+                    pic->frame.AllocByFormat (info.width, info.height, dstFmt);
+
+                pic->idx = dec->GetFrameIndex();
+                pic->duration = dec->GetFrameDuration();
+                if (dec->Convert (dstFmt, pic->frame.ptr, pic->frame.stride, quality) < 0)
+                    throw runtime_error ("conversion failed");
+                ok = true;
+            }
+        }
+        catch (const exception &e) {
+            Logi ("%s: %s\n", __FUNCTION__, e.what());
+            e_ptr = current_exception();
+        }
+
+        lock_guard _l(mtx);
+
+        if (ok)
+            readyPics.push (pic);
+        else
+        {
+            freePics.push_back (pic);
+            bEos = true;
+            err = e_ptr;
+        }
+
+        cv.notify_all();
+    }
+}
+
+
+/**
+ * Get next frame, wait if it is not ready yet
+ * @return NULL if end of animation. The previous returned frame becomes invalid.
+ * @throw Error of decoding / conversion, after frames ready before it
+ */
+const AnimReader::Picture* AnimReader::GetFrame()
+{
+    {
+        lock_guard _l(mtx);
+
+        /* Release the frame being displayed */
+        if (curPic)
+            freePics.push_back (curPic);
+        curPic = NULL;
+    }
+
+    kick();
+
+    lock_guard _l(mtx);
+
+    while (readyPics.empty() && (bRunning || !bEos))
+    {
+        if (!bRunning) // Producer is idle, e.g. start-up
+        {
+            mtx.unlock();
+            kick();
+            mtx.lock();
+            continue;
+        }
+
+        cv.wait (mtx);
+    }
+
+    if (readyPics.empty())
+    {
+        if (err)
+            rethrow_exception (err);
+        return NULL;
+    }
+
+    curPic = readyPics.front();
+    readyPics.pop();
+    return curPic;
+}
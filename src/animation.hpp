@@ -0,0 +1,88 @@
+/**
+ * @file
+ * Animated BPG playback with background frame prefetch
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+#ifndef _ANIMATION_HPP_
+#define _ANIMATION_HPP_
+
+#include <stdint.h>
+
+#include <vector>
+#include <queue>
+#include <memory>
+#include <exception>
+
+#include "bpg_common.hpp"
+
+
+namespace bpg {
+
+/**
+ * Animation frame source
+ *
+ * Frames N+1..N+k are decoded and converted on the thread pool while frame N
+ * is being displayed. Memory is bounded by a fixed number of frame buffers.
+ */
+class AnimReader
+{
+public:
+    /** A converted animation frame */
+    struct Picture
+    {
+        Frame frame;
+        int idx;            ///< Frame index within one loop
+        uint32_t duration;  ///< Display duration in ms
+    };
+
+    enum {
+        DEFAULT_DEPTH = 3,  ///< Default number of frame buffers
+        LOOP_ONCE = -1,     ///< Ignore loop count of the file, play once
+    };
+
+    AnimReader (ThreadPool &pool, int depth = DEFAULT_DEPTH);
+    ~AnimReader();
+
+    void Open (
+        const void *buf, size_t len,
+        enum AVPixelFormat dst_fmt,
+        int quality = -1,
+        int loops = 0
+    );
+
+    const ImageInfo& GetInfo() const { return info; }
+
+    const Picture* GetFrame();
+
+private:
+    ThreadPool &pool;
+    std::vector<uint8_t> data;
+    std::unique_ptr<Decoder> dec;
+    ImageInfo info;
+    enum AVPixelFormat dstFmt;
+    int quality;
+    int loopsLeft;          ///< Remaining loops, 0 for infinite
+    bool bFirst;            ///< Current frame of decoder is not consumed yet
+
+    std::unique_ptr<Picture[]> pics;
+    std::vector<Picture*> freePics;
+    std::queue<Picture*> readyPics;
+    Picture *curPic;
+
+    winthread::mutex mtx;
+    winthread::cond_var cv;
+    bool bRunning;          ///< Producer task is queued or running
+    bool bEos;              ///< No more frame
+    bool bStop;
+    std::exception_ptr err; ///< Error of producer, thrown by GetFrame()
+
+    bool nextFrame();
+    void kick();
+    void produce();
+    void stop();
+};
+
+} // namespace bpg
+
+#endif /* _ANIMATION_HPP_ */
@@ -1,33 +1,197 @@
 /**
  * @file
- *
+ * Properties of pixel formats used by this project
  *
  * @author Leav Wu (leavinel@gmail.com)
  */
 #ifndef _AV_UTIL_HPP_
 #define _AV_UTIL_HPP_
 
+#include <stddef.h>
+#include <stdint.h>
 
 extern "C" {
-#include "libavutil/pixdesc.h"
+#include "libavutil/pixfmt.h"
+#include "libbpg.h"
 }
 
-#undef EXT
-#ifdef AV_UTIL_SET
-#define EXT
-#else
-#define EXT extern
-#endif
-
 
-/** Explicit libavutil.dll loader */
+/**
+ * Compile-time replacement of av_pix_fmt_desc_get()
+ *
+ * Only formats of BPG planes and frames are listed, so libavutil is not
+ * needed to be loaded for them.
+ */
 namespace avutil {
 
-void init();
-void deinit();
+enum {
+    PIX_FLAG_PLANAR = 1 << 0,
+    PIX_FLAG_RGB    = 1 << 1,
+    PIX_FLAG_ALPHA  = 1 << 2,
+    PIX_FLAG_BE     = 1 << 3,
+};
+
+
+struct PixFmtDesc
+{
+    enum AVPixelFormat fmt;
+    uint8_t planes;
+    uint8_t log2_chroma_w;
+    uint8_t log2_chroma_h;
+    uint8_t flags;          ///< PIX_FLAG_*
+    uint8_t depth;          ///< Bits of a component
+    uint8_t step;           ///< Bytes of a pixel (packed) or a sample (planar)
+
+    constexpr bool isPlanar() const { return flags & PIX_FLAG_PLANAR; }
+    constexpr bool isRGB() const    { return flags & PIX_FLAG_RGB; }
+    constexpr bool hasAlpha() const { return flags & PIX_FLAG_ALPHA; }
+    constexpr bool isBE() const     { return flags & PIX_FLAG_BE; }
+
+    /** Chroma planes of planar YUV are subsampled */
+    constexpr bool isChroma (int plane) const {
+        return isPlanar() && !isRGB() && (plane == 1 || plane == 2);
+    }
+
+    constexpr int rowShift (int plane) const {
+        return isChroma (plane) ? log2_chroma_h : 0;
+    }
+
+    /** Bytes of a row of a plane, for width w */
+    constexpr int lineSize (int plane, int w) const {
+        return isChroma (plane) ?
+            step * ((w + (1 << log2_chroma_w) - 1) >> log2_chroma_w) :
+            step * w;
+    }
+};
+
+
+#define P   PIX_FLAG_PLANAR
+#define R   PIX_FLAG_RGB
+#define A   PIX_FLAG_ALPHA
+#define B   PIX_FLAG_BE
+
+constexpr PixFmtDesc PIX_FMT_DESCS[] = {
+    /* Frames */
+    {AV_PIX_FMT_GRAY8,          1, 0, 0, 0,         8,  1},
+    {AV_PIX_FMT_RGB24,          1, 0, 0, R,         8,  3},
+    {AV_PIX_FMT_BGR24,          1, 0, 0, R,         8,  3},
+    {AV_PIX_FMT_RGBA,           1, 0, 0, R|A,       8,  4},
+    {AV_PIX_FMT_BGRA,           1, 0, 0, R|A,       8,  4},
+
+    /* BPG planes */
+    {AV_PIX_FMT_GRAY16BE,       1, 0, 0, B,         16, 2},
+    {AV_PIX_FMT_GBRP16BE,       3, 0, 0, P|R|B,     16, 2},
+    {AV_PIX_FMT_GBRAP16BE,      4, 0, 0, P|R|A|B,   16, 2},
+
+    {AV_PIX_FMT_YUV420P16BE,    3, 1, 1, P|B,       16, 2},
+    {AV_PIX_FMT_YUV420P9LE,     3, 1, 1, P,         9,  2},
+    {AV_PIX_FMT_YUV420P10LE,    3, 1, 1, P,         10, 2},
+    {AV_PIX_FMT_YUV420P12LE,    3, 1, 1, P,         12, 2},
+    {AV_PIX_FMT_YUV420P14LE,    3, 1, 1, P,         14, 2},
+    {AV_PIX_FMT_YUVA420P16BE,   4, 1, 1, P|A|B,     16, 2},
+    {AV_PIX_FMT_YUVA420P9LE,    4, 1, 1, P|A,       9,  2},
+    {AV_PIX_FMT_YUVA420P10LE,   4, 1, 1, P|A,       10, 2},
+
+    {AV_PIX_FMT_YUV422P16BE,    3, 1, 0, P|B,       16, 2},
+    {AV_PIX_FMT_YUV422P9LE,     3, 1, 0, P,         9,  2},
+    {AV_PIX_FMT_YUV422P10LE,    3, 1, 0, P,         10, 2},
+    {AV_PIX_FMT_YUV422P12LE,    3, 1, 0, P,         12, 2},
+    {AV_PIX_FMT_YUV422P14LE,    3, 1, 0, P,         14, 2},
+    {AV_PIX_FMT_YUVA422P16BE,   4, 1, 0, P|A|B,     16, 2},
+    {AV_PIX_FMT_YUVA422P9LE,    4, 1, 0, P|A,       9,  2},
+    {AV_PIX_FMT_YUVA422P10LE,   4, 1, 0, P|A,       10, 2},
+
+    {AV_PIX_FMT_YUV444P16BE,    3, 0, 0, P|B,       16, 2},
+    {AV_PIX_FMT_YUV444P9LE,     3, 0, 0, P,         9,  2},
+    {AV_PIX_FMT_YUV444P10LE,    3, 0, 0, P,         10, 2},
+    {AV_PIX_FMT_YUV444P12LE,    3, 0, 0, P,         12, 2},
+    {AV_PIX_FMT_YUV444P14LE,    3, 0, 0, P,         14, 2},
+    {AV_PIX_FMT_YUVA444P16BE,   4, 0, 0, P|A|B,     16, 2},
+    {AV_PIX_FMT_YUVA444P9LE,    4, 0, 0, P|A,       9,  2},
+    {AV_PIX_FMT_YUVA444P10LE,   4, 0, 0, P|A,       10, 2},
+};
 
-EXT const AVPixFmtDescriptor *(*av_pix_fmt_desc_get)(enum AVPixelFormat pix_fmt);
-EXT int (*av_pix_fmt_count_planes)(enum AVPixelFormat pix_fmt);
+#undef P
+#undef R
+#undef A
+#undef B
+
+
+/**
+ * @return NULL if fmt is not listed
+ */
+constexpr const PixFmtDesc* GetPixFmtDesc (enum AVPixelFormat fmt, size_t i = 0)
+{
+    return i >= sizeof(PIX_FMT_DESCS) / sizeof(PIX_FMT_DESCS[0]) ? nullptr :
+        PIX_FMT_DESCS[i].fmt == fmt ? &PIX_FMT_DESCS[i] :
+        GetPixFmtDesc (fmt, i + 1);
+}
+
+
+/**
+ * Plane format of decoded BPG images, see ImageInfo::GetAVPixFmt()
+ */
+struct BpgPixFmt
+{
+    uint8_t format;         ///< BPG_FORMAT_*, video formats as their still ones
+    bool alpha;
+    bool rgb;               ///< BPG_CS_RGB
+    uint8_t depth;          ///< Bit depth, 0 for any
+    enum AVPixelFormat fmt;
+};
+
+constexpr BpgPixFmt BPG_PIX_FMTS[] = {
+    /* 8-bit planes are given as 16-bit by libbpg */
+    {BPG_FORMAT_GRAY,   false,  false,  0,  AV_PIX_FMT_GRAY16BE},
+    {BPG_FORMAT_444,    false,  true,   0,  AV_PIX_FMT_GBRP16BE},
+    {BPG_FORMAT_444,    true,   true,   0,  AV_PIX_FMT_GBRAP16BE},
+
+    {BPG_FORMAT_420,    false,  false,  8,  AV_PIX_FMT_YUV420P16BE},
+    {BPG_FORMAT_420,    false,  false,  9,  AV_PIX_FMT_YUV420P9LE},
+    {BPG_FORMAT_420,    false,  false,  10, AV_PIX_FMT_YUV420P10LE},
+    {BPG_FORMAT_420,    false,  false,  12, AV_PIX_FMT_YUV420P12LE},
+    {BPG_FORMAT_420,    false,  false,  14, AV_PIX_FMT_YUV420P14LE},
+    {BPG_FORMAT_420,    true,   false,  8,  AV_PIX_FMT_YUVA420P16BE},
+    {BPG_FORMAT_420,    true,   false,  9,  AV_PIX_FMT_YUVA420P9LE},
+    {BPG_FORMAT_420,    true,   false,  10, AV_PIX_FMT_YUVA420P10LE},
+
+    {BPG_FORMAT_422,    false,  false,  8,  AV_PIX_FMT_YUV422P16BE},
+    {BPG_FORMAT_422,    false,  false,  9,  AV_PIX_FMT_YUV422P9LE},
+    {BPG_FORMAT_422,    false,  false,  10, AV_PIX_FMT_YUV422P10LE},
+    {BPG_FORMAT_422,    false,  false,  12, AV_PIX_FMT_YUV422P12LE},
+    {BPG_FORMAT_422,    false,  false,  14, AV_PIX_FMT_YUV422P14LE},
+    {BPG_FORMAT_422,    true,   false,  8,  AV_PIX_FMT_YUVA422P16BE},
+    {BPG_FORMAT_422,    true,   false,  9,  AV_PIX_FMT_YUVA422P9LE},
+    {BPG_FORMAT_422,    true,   false,  10, AV_PIX_FMT_YUVA422P10LE},
+
+    {BPG_FORMAT_444,    false,  false,  8,  AV_PIX_FMT_YUV444P16BE},
+    {BPG_FORMAT_444,    false,  false,  9,  AV_PIX_FMT_YUV444P9LE},
+    {BPG_FORMAT_444,    false,  false,  10, AV_PIX_FMT_YUV444P10LE},
+    {BPG_FORMAT_444,    false,  false,  12, AV_PIX_FMT_YUV444P12LE},
+    {BPG_FORMAT_444,    false,  false,  14, AV_PIX_FMT_YUV444P14LE},
+    {BPG_FORMAT_444,    true,   false,  8,  AV_PIX_FMT_YUVA444P16BE},
+    {BPG_FORMAT_444,    true,   false,  9,  AV_PIX_FMT_YUVA444P9LE},
+    {BPG_FORMAT_444,    true,   false,  10, AV_PIX_FMT_YUVA444P10LE},
+};
+
+
+/**
+ * @param format    BPG_FORMAT_*
+ * @param rgb       BPG_CS_RGB, only for BPG_FORMAT_444
+ * @return AV_PIX_FMT_NONE if not supported
+ */
+constexpr enum AVPixelFormat GetBpgPixFmt (int format, bool alpha, bool rgb, int depth, size_t i = 0)
+{
+    return
+        format == BPG_FORMAT_420_VIDEO ? GetBpgPixFmt (BPG_FORMAT_420, alpha, rgb, depth) :
+        format == BPG_FORMAT_422_VIDEO ? GetBpgPixFmt (BPG_FORMAT_422, alpha, rgb, depth) :
+        format == BPG_FORMAT_GRAY && (alpha || rgb) ? GetBpgPixFmt (format, false, false, depth) :
+        format != BPG_FORMAT_444 && rgb ? GetBpgPixFmt (format, alpha, false, depth) :
+        i >= sizeof(BPG_PIX_FMTS) / sizeof(BPG_PIX_FMTS[0]) ? AV_PIX_FMT_NONE :
+        BPG_PIX_FMTS[i].format == format && BPG_PIX_FMTS[i].alpha == alpha && BPG_PIX_FMTS[i].rgb == rgb &&
+            (BPG_PIX_FMTS[i].depth == 0 || BPG_PIX_FMTS[i].depth == depth) ? BPG_PIX_FMTS[i].fmt :
+        GetBpgPixFmt (format, alpha, rgb, depth, i + 1);
+}
 
 }
 
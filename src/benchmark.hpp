@@ -26,4 +26,34 @@ public:
 };
 
 
+/**
+ * High resolution timer based on performance counter
+ */
+class Stopwatch
+{
+private:
+    LARGE_INTEGER freq;
+    LARGE_INTEGER begin;
+
+public:
+    Stopwatch() {
+        QueryPerformanceFrequency (&freq);
+        Reset();
+    }
+
+    void Reset() {
+        QueryPerformanceCounter (&begin);
+    }
+
+    /** Elapsed time since last reset, in microseconds */
+    double GetUs() const {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter (&now);
+        return (double)(now.QuadPart - begin.QuadPart) * 1e6 / freq.QuadPart;
+    }
+
+    double GetMs() const { return GetUs() / 1000; }
+};
+
+
 #endif /* _BENCHMARK_HPP_ */
@@ -13,7 +13,10 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
+#include <list>
 #include <memory>
+#include <functional>
 
 #include "bpg_def.h"
 
@@ -28,7 +31,9 @@ extern "C" {
 
 #include "threadpool.hpp"
 #include "sws_context.hpp"
+#include "convert.hpp"
 #include "frame.hpp"
+#include "benchmark.hpp"
 
 #undef EXT
 #ifdef BPG_COMMON_SET
@@ -48,7 +53,11 @@ extern "C" {
 
 namespace bpg {
 
+class DecoderPool;
+
 EXT ThreadPool *gThreadPool;
+EXT FramePool *gFramePool;     ///< Optional, frames are allocated from system if NULL
+EXT DecoderPool *gDecoderPool;  ///< Optional, decoders are created each time if NULL
 
 typedef std::unique_ptr<FILE, int(*)(FILE*)> pFILE;
 
@@ -84,20 +93,44 @@ class Decoder
 {
 private:
     pBPGDecoderContext ctx;
+    std::unique_ptr<Decoder> alphaDec;  ///< Decoder of separated alpha stream
+    bool bAlphaSplit;                   ///< Alpha is in alphaDec
+    bool bUsed;                         ///< ctx has decoded
     ImageInfo info;
+    int frameIdx;
+    CancelToken cancel;
+
+    /* Scratch buffers, reused by next decoding */
+    std::vector<uint8_t> fileBuf;
+    std::vector<uint8_t> streams[2];    ///< Separated colour / alpha streams
+
+    void decodeSplit (const void *buf, size_t len);
+    int setupContext (sws::Context &swsCtx, int w, int h, int dw, int dh, enum AVPixelFormat dst_fmt, int quality);
+    void getPlanes (const uint8_t *src[4], int src_stride[4], int x, int y);
+    void getSource (conv::Source &src);
 
 public:
     enum {
-        OPT_HEADER_ONLY = 1,
+        OPT_HEADER_ONLY = 1 << 0,
+        OPT_SERIAL      = 1 << 1,   ///< Decode alpha & colour streams sequentially by libbpg
     };
 
     Decoder();
+    void Reset();
+
+    /** Decoding / conversion gives up once cancelled, libbpg decoding of a stream can not be interrupted */
+    void SetCancelToken (const CancelToken &cancel) { this->cancel = cancel; }
+    const CancelToken& GetCancelToken() const { return cancel; }
 
     void DecodeFile (const char *s_file, uint8_t opts = 0);
     void DecodeBuffer (const void *buf, size_t len, uint8_t opts = 0);
 
     const ImageInfo& GetInfo() const { return info; }
 
+    bool NextFrame();
+    int GetFrameIndex() const { return frameIdx; }
+    uint32_t GetFrameDuration() const;
+
     int Convert (
         enum AVPixelFormat dst_fmt,
         void *dst,
@@ -105,10 +138,93 @@ public:
         int quality = -1
     );
 
+    int Convert (
+        enum AVPixelFormat dst_fmt,
+        void *dst,
+        int dst_stride,
+        int dst_w, int dst_h,
+        int quality = -1,
+        int filter = sws::Context::FILTER_AUTO
+    );
+
+    int ConvertRect (
+        enum AVPixelFormat dst_fmt,
+        void *dst,
+        int dst_stride,
+        int x, int y, int w, int h,
+        int quality = -1
+    );
+
     int ConvertToFrame (Frame &frame, int quality = -1);
 };
 
 
+/**
+ * Row-by-row access of a decoded image, as ConvertToFrame() would give
+ *
+ * Rows are converted a band at a time when first requested, into a buffer
+ * small enough to stay in cache until they are copied out, instead of
+ * converting the whole frame into memory first.
+ *
+ * Export() passes the whole image band by band, so images larger than the
+ * address space allows as a frame can be saved with bounded memory.
+ */
+class BandReader
+{
+private:
+    Decoder &dec;
+    int quality;
+    enum AVPixelFormat fmt;
+    Frame band;
+    int bandRows;
+    int y0, y1;             ///< Rows in band
+
+    void load (int y);
+
+public:
+    enum { BAND_BYTES = 2 << 20, MIN_BAND_ROWS = 64 };
+
+    /** Receives rows [y, y + band.h) */
+    typedef std::function<void(int y, const FrameDesc &band)> BandFunc;
+
+    BandReader (Decoder &dec, int quality = -1);
+
+    enum AVPixelFormat GetFormat() const { return fmt; }
+    void GetLine (int y, void *dst);
+
+    void Export (const BandFunc &func);
+    void Export (FILE *fp);
+};
+
+
+
+/**
+ * Idle decoders for reuse
+ *
+ * Sequential decoding of similar images takes a decoder whose scratch buffers
+ * are already large enough. Decoded planes are allocated by libbpg, which
+ * frees them with its context, so they are not kept.
+ */
+class DecoderPool
+{
+private:
+    winthread::mutex mtx;
+    std::vector<std::unique_ptr<Decoder>> idle;
+    size_t maxIdle;
+
+public:
+    DecoderPool (size_t maxIdle = 4): maxIdle(maxIdle) {}
+
+    std::unique_ptr<Decoder> Get();
+    void Put (std::unique_ptr<Decoder> &&dec);
+};
+
+
+std::unique_ptr<Decoder> AcquireDecoder();
+void ReleaseDecoder (std::unique_ptr<Decoder> &&dec);
+
+bool IsCpuSupported();
+
 
 /**
  * RGB color
@@ -185,17 +301,128 @@ public:
 
 typedef std::unique_ptr<BPGEncoderContext, void(*)(BPGEncoderContext*)> pBPGEncoderContext;
 
+class encImage;
+
 /**
  * Wrapper of #BPGEncoderContext
+ *
+ * An image is encoded from a whole frame by Encode(), or streamed by Begin(),
+ * PutRows() and Finish(): rows are converted into the YUV image band by band
+ * on the thread pool while next rows come, so no full RGB frame is kept.
  */
 class Encoder
 {
 private:
+    friend class AnimEncoder;
+    struct stream;
+
+    /** Encodes colour or alpha planes with given parameters, see encodeSplit() */
+    typedef std::function<void(const EncParam &param, uint8_t planes, std::vector<uint8_t> &out)> splitFunc;
+
     static int writeFunc (void *opaque, const uint8_t *buf, int buf_len);
+    static int memWriteFunc (void *opaque, const uint8_t *buf, int buf_len);
+
+    CancelToken cancel;
+    sws::Context swsCtx;    ///< Colour conversion, kept warm for next image of same size
+    std::unique_ptr<stream> strm;   ///< Image being streamed
+
+    void encode (const EncParam &param, encImage &img, BPGEncoderWriteFunc *write_func, void *opaque);
+    void encode (
+        const EncParam &param, const FrameDesc &frame, uint8_t planes,
+        BPGEncoderWriteFunc *write_func, void *opaque
+    );
+    void encodeSplit (FILE *fp, const EncParam &param, const splitFunc &enc);
+
+    void convertBand (int idx, int y, int rows);
+    void flushBand();
+    void waitConvert();
+    void abort();
 
 public:
-    Encoder(){}
+    Encoder();
+    ~Encoder();
+    void SetCancelToken (const CancelToken &cancel) { this->cancel = cancel; }
+
+    /** @throw Cancelled if cancelled */
     void Encode (FILE *fp, const EncParam &param, const FrameDesc &frame);
+
+    void Begin (FILE *fp, const EncParam &param, int w, int h, enum AVPixelFormat fmt);
+    void PutRows (int y, int rows, const void *src, int stride);
+    void Finish();
+};
+
+
+/**
+ * Animated BPG encoder
+ * RGB -> YUV conversion of the upcoming frame runs on the thread pool
+ * while the current frame is being encoded.
+ */
+class AnimEncoder
+{
+private:
+    EncParam param;
+    pBPGEncoderContext ctx;
+    FILE *fp;
+    std::unique_ptr<encImage> imgs[2];  ///< Double-buffered YUV images
+    uint32_t durations[2];
+    uint32_t w, h;                      ///< Size of the first frame
+    int frameCnt;
+    PoolTask convTask;
+    std::string sConvErr;
+    Stopwatch sw;
+    double fps;
+    CancelToken cancel;
+    sws::Context swsCtx;
+
+    void convert (int idx, const FrameDesc &frame);
+    void waitConvert();
+    void encode (int idx);
+
+public:
+    AnimEncoder();
+    ~AnimEncoder();
+
+    void SetCancelToken (const CancelToken &cancel) { this->cancel = cancel; }
+
+    void Begin (FILE *fp, const EncParam &param, int loop_count = 0);
+    void AddFrame (const FrameDesc &frame, uint32_t duration);
+    void Finish();
+
+    int GetFrameCount() const { return frameCnt; }
+    double GetFps() const { return fps; }
+};
+
+
+/**
+ * Encoders kept for bulk encoding, keyed by parameters and frame geometry
+ *
+ * An idle encoder of the same parameters, format and size is reused, so its
+ * conversion contexts are already initialized. libbpg closes the HEVC encoder
+ * after each still image, so x265 is still initialized per image.
+ */
+class EncoderPool
+{
+private:
+    struct slot {
+        std::string key;
+        std::unique_ptr<Encoder> enc;
+    };
+
+    winthread::mutex mtx;
+    std::list<slot> idle;       ///< Most recently used first
+    size_t maxIdle;
+
+    static std::string makeKey (const EncParam &param, const FrameDesc &frame);
+
+public:
+    EncoderPool (size_t maxIdle = 8);
+
+    /** frame gives format & size only, its buffer is not used */
+    std::unique_ptr<Encoder> Get (const EncParam &param, const FrameDesc &frame);
+    void Put (const EncParam &param, const FrameDesc &frame, std::unique_ptr<Encoder> &&enc);
+
+    void Encode (FILE *fp, const EncParam &param, const FrameDesc &frame, const CancelToken &cancel = CancelToken());
+    void Clear();
 };
 
 
@@ -0,0 +1,307 @@
+/**
+ * @file
+ * BPG file structure parser / writer
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <string.h>
+#include <stdexcept>
+
+#include "bpg_stream.hpp"
+#include "bpg_common.hpp"
+
+using namespace std;
+using namespace bpg;
+
+
+/**
+ * Read ue7(32): 7 bits per byte, MSB first, bit 7 set if more bytes follow
+ */
+static uint32_t get_ue7 (const uint8_t *buf, size_t len, size_t &pos)
+{
+    uint32_t v = 0;
+
+    for (int i = 0; i < 5; i++)
+    {
+        if (pos >= len)
+            break;
+
+        uint8_t b = buf[pos++];
+        v = (v << 7) | (b & 0x7F);
+
+        if (!(b & 0x80))
+            return v;
+    }
+
+    throw runtime_error ("invalid BPG stream");
+}
+
+
+static void put_ue7 (vector<uint8_t> &out, uint32_t v)
+{
+    int n = 1;
+
+    while (n < 5 && (v >> (7 * n)))
+        n++;
+
+    for (int i = n - 1; i > 0; i--)
+        out.push_back (0x80 | ((v >> (7 * i)) & 0x7F));
+
+    out.push_back (v & 0x7F);
+}
+
+
+/**
+ * Get a hevc_header() block including its length field
+ */
+static const uint8_t *get_hevc_header (const uint8_t *buf, size_t len, size_t &pos, size_t &hdr_len)
+{
+    size_t begin = pos;
+    uint32_t sz = get_ue7 (buf, len, pos);
+
+    if (sz > len - pos)
+        throw runtime_error ("invalid BPG stream");
+
+    pos += sz;
+    hdr_len = pos - begin;
+    return buf + begin;
+}
+
+
+int NalUnit::GetLayerId() const
+{
+    const uint8_t *hdr = ptr + hdrOfs;
+    return ((hdr[0] & 1) << 5) | (hdr[1] >> 3);
+}
+
+
+BpgStream::BpgStream():
+    pixelFormat(0), alpha1(0), bitDepth(0), colorSpace(0),
+    alpha2(0), limitedRange(0), animation(0),
+    width(0), height(0),
+    ext(NULL), extLen(0),
+    alphaHdr(NULL), alphaHdrLen(0),
+    colorHdr(NULL), colorHdrLen(0),
+    data(NULL), dataLen(0)
+{
+}
+
+
+/**
+ * Parse a BPG file in buffer (the buffer shall be kept valid)
+ */
+void BpgStream::Parse (const void *_buf, size_t len)
+{
+    const uint8_t *buf = (const uint8_t*)_buf;
+    size_t pos;
+    uint8_t ext_flag;
+
+    if (len < ImageInfo::HEADER_MAGIC_SIZE + 2 || !ImageInfo::CheckHeader (buf, len))
+        throw runtime_error ("not a BPG stream");
+
+    pos = ImageInfo::HEADER_MAGIC_SIZE;
+    pixelFormat  = buf[pos] >> 5;
+    alpha1       = (buf[pos] >> 4) & 1;
+    bitDepth     = (buf[pos] & 0xF) + 8;
+    pos++;
+    colorSpace   = buf[pos] >> 4;
+    ext_flag     = (buf[pos] >> 3) & 1;
+    alpha2       = (buf[pos] >> 2) & 1;
+    limitedRange = (buf[pos] >> 1) & 1;
+    animation    = buf[pos] & 1;
+    pos++;
+
+    width  = get_ue7 (buf, len, pos);
+    height = get_ue7 (buf, len, pos);
+
+    size_t pic_len = get_ue7 (buf, len, pos);
+
+    ext = NULL;
+    extLen = 0;
+
+    if (ext_flag)
+    {
+        extLen = get_ue7 (buf, len, pos);
+        if (extLen > len - pos)
+            throw runtime_error ("invalid BPG stream");
+
+        ext = buf + pos;
+        pos += extLen;
+    }
+
+    /* picture_data_length 0 means up to the end of file */
+    size_t end = len;
+    if (pic_len && pic_len <= len - pos)
+        end = pos + pic_len;
+
+    alphaHdr = NULL;
+    alphaHdrLen = 0;
+
+    if (alpha1 || alpha2)
+        alphaHdr = get_hevc_header (buf, end, pos, alphaHdrLen);
+
+    colorHdr = get_hevc_header (buf, end, pos, colorHdrLen);
+
+    data = buf + pos;
+    dataLen = end - pos;
+}
+
+
+/**
+ * Write heic_file() header & extension_data()
+ * @param picture_data_len Length of the following hevc_header_and_data()
+ */
+void BpgStream::WriteHeader (vector<uint8_t> &out, size_t picture_data_len) const
+{
+    for (int i = ImageInfo::HEADER_MAGIC_SIZE - 1; i >= 0; i--)
+        out.push_back ((BPG_HEADER_MAGIC >> (i * 8)) & 0xFF);
+
+    out.push_back ((pixelFormat << 5) | (alpha1 << 4) | (bitDepth - 8));
+    out.push_back ((colorSpace << 4) | ((ext ? 1 : 0) << 3) | (alpha2 << 2) | (limitedRange << 1) | animation);
+
+    put_ue7 (out, width);
+    put_ue7 (out, height);
+    put_ue7 (out, picture_data_len);
+
+    if (ext)
+    {
+        put_ue7 (out, extLen);
+        out.insert (out.end(), ext, ext + extLen);
+    }
+}
+
+
+/**
+ * Split hevc_data() into NAL units by start code (00 00 01 / 00 00 00 01)
+ */
+void BpgStream::SplitNals (const uint8_t *buf, size_t len, vector<NalUnit> &nals)
+{
+    size_t pos = 0;
+
+    nals.clear();
+
+    while (pos + 3 < len)
+    {
+        NalUnit nal;
+
+        if (buf[pos] == 0 && buf[pos+1] == 0 && buf[pos+2] == 1)
+            nal.hdrOfs = 3;
+        else if (buf[pos] == 0 && buf[pos+1] == 0 && buf[pos+2] == 0 && buf[pos+3] == 1)
+            nal.hdrOfs = 4;
+        else
+            throw runtime_error ("invalid HEVC stream");
+
+        if (pos + nal.hdrOfs + 2 > len)
+            throw runtime_error ("invalid HEVC stream");
+
+        /* Find next start code */
+        size_t end = pos + nal.hdrOfs + 2;
+        while (end + 3 <= len && !(buf[end] == 0 && buf[end+1] == 0 && buf[end+2] == 1))
+            end++;
+
+        if (end + 3 > len)
+            end = len;
+        else if (buf[end-1] == 0) // 4-byte start code
+            end--;
+
+        nal.ptr = buf + pos;
+        nal.len = end - pos;
+        nals.push_back (nal);
+        pos = end;
+    }
+}
+
+
+/**
+ * Append a NAL unit with specified nuh_layer_id
+ */
+void BpgStream::PutNal (vector<uint8_t> &out, const NalUnit &nal, int layer_id)
+{
+    size_t ofs = out.size() + nal.hdrOfs;
+
+    out.insert (out.end(), nal.ptr, nal.ptr + nal.len);
+    out[ofs]   = (out[ofs] & 0xFE) | ((layer_id >> 5) & 1);
+    out[ofs+1] = (out[ofs+1] & 0x07) | ((layer_id & 0x1F) << 3);
+}
+
+
+/**
+ * Mux a colour-only BPG and a grayscale BPG (as alpha plane) into one file
+ */
+void BpgStream::MuxAlpha (const vector<uint8_t> &color, const vector<uint8_t> &alpha, vector<uint8_t> &out)
+{
+    BpgStream c, a;
+    vector<NalUnit> nals;
+    vector<uint8_t> pic;
+
+    c.Parse (&color[0], color.size());
+    a.Parse (&alpha[0], alpha.size());
+
+    if (c.alphaHdr || c.animation || a.animation || a.pixelFormat != BPG_FORMAT_GRAY ||
+        c.width != a.width || c.height != a.height || c.bitDepth != a.bitDepth)
+        throw runtime_error ("incompatible colour / alpha streams");
+
+    /* hevc_header_and_data(): alpha header, colour header, alpha NALs, colour NALs */
+    pic.insert (pic.end(), a.colorHdr, a.colorHdr + a.colorHdrLen);
+    pic.insert (pic.end(), c.colorHdr, c.colorHdr + c.colorHdrLen);
+
+    SplitNals (a.data, a.dataLen, nals);
+    for (size_t i = 0; i < nals.size(); i++)
+        PutNal (pic, nals[i], 1);
+
+    pic.insert (pic.end(), c.data, c.data + c.dataLen);
+
+    c.alpha1 = 1;
+    out.clear();
+    c.WriteHeader (out, pic.size());
+    out.insert (out.end(), pic.begin(), pic.end());
+}
+
+
+/**
+ * Split a BPG file with alpha into a colour-only BPG and a grayscale BPG (alpha plane)
+ * Only 8-bit still images with non-premultiplied alpha are supported
+ */
+void BpgStream::SplitAlpha (const void *buf, size_t len, vector<uint8_t> &color, vector<uint8_t> &alpha)
+{
+    BpgStream in, c, a;
+    vector<NalUnit> nals;
+    vector<uint8_t> cpic, apic;
+
+    in.Parse (buf, len);
+
+    if (!in.alpha1 || in.alpha2 || in.animation || in.bitDepth != 8)
+        throw runtime_error ("unsupported alpha stream");
+
+    cpic.insert (cpic.end(), in.colorHdr, in.colorHdr + in.colorHdrLen);
+    apic.insert (apic.end(), in.alphaHdr, in.alphaHdr + in.alphaHdrLen);
+
+    SplitNals (in.data, in.dataLen, nals);
+    for (size_t i = 0; i < nals.size(); i++)
+    {
+        switch (nals[i].GetLayerId())
+        {
+        case 0:  PutNal (cpic, nals[i], 0); break;
+        case 1:  PutNal (apic, nals[i], 0); break;
+        default: throw runtime_error ("invalid HEVC stream");
+        }
+    }
+
+    /* Colour: same as input without alpha */
+    c = in;
+    c.alpha1 = 0;
+    color.clear();
+    c.WriteHeader (color, cpic.size());
+    color.insert (color.end(), cpic.begin(), cpic.end());
+
+    /* Alpha: full-range grayscale */
+    a.pixelFormat = BPG_FORMAT_GRAY;
+    a.bitDepth = in.bitDepth;
+    a.colorSpace = BPG_CS_YCbCr;
+    a.width = in.width;
+    a.height = in.height;
+    alpha.clear();
+    a.WriteHeader (alpha, apic.size());
+    alpha.insert (alpha.end(), apic.begin(), apic.end());
+}
@@ -0,0 +1,84 @@
+/**
+ * @file
+ * BPG file structure parser / writer
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+#ifndef _BPG_STREAM_HPP_
+#define _BPG_STREAM_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+
+namespace bpg {
+
+/**
+ * A HEVC NAL unit in hevc_data(), with its start code
+ */
+struct NalUnit
+{
+    const uint8_t *ptr;     ///< Start code
+    size_t len;             ///< Length including start code
+    uint8_t hdrOfs;         ///< Offset of NAL header (start code size)
+
+    int GetLayerId() const;
+};
+
+
+/**
+ * BPG file layout
+ *
+ *   heic_file() header, extension_data(),
+ *   hevc_header() of alpha (if any), hevc_header() of colour,
+ *   hevc_data(): NAL units, alpha ones carry nuh_layer_id = 1
+ */
+class BpgStream
+{
+public:
+    uint8_t pixelFormat;
+    uint8_t alpha1;
+    uint8_t bitDepth;
+    uint8_t colorSpace;
+    uint8_t alpha2;
+    uint8_t limitedRange;
+    uint8_t animation;
+    uint32_t width, height;
+
+    const uint8_t *ext;     ///< extension_data(), NULL if not present
+    uint32_t extLen;
+
+    const uint8_t *alphaHdr;    ///< hevc_header() of alpha with its length field, NULL if no alpha
+    size_t alphaHdrLen;
+    const uint8_t *colorHdr;    ///< hevc_header() of colour with its length field
+    size_t colorHdrLen;
+
+    const uint8_t *data;        ///< hevc_data()
+    size_t dataLen;
+
+    BpgStream();
+
+    void Parse (const void *buf, size_t len);
+    void WriteHeader (std::vector<uint8_t> &out, size_t picture_data_len) const;
+
+    static void SplitNals (const uint8_t *buf, size_t len, std::vector<NalUnit> &nals);
+    static void PutNal (std::vector<uint8_t> &out, const NalUnit &nal, int layer_id);
+
+    static void MuxAlpha (
+        const std::vector<uint8_t> &color,
+        const std::vector<uint8_t> &alpha,
+        std::vector<uint8_t> &out
+    );
+
+    static void SplitAlpha (
+        const void *buf, size_t len,
+        std::vector<uint8_t> &color,
+        std::vector<uint8_t> &alpha
+    );
+};
+
+} // namespace bpg
+
+#endif /* _BPG_STREAM_HPP_ */
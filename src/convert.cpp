@@ -0,0 +1,440 @@
+/**
+ * @file
+ * Direct conversion of BPG planes to RGB frames
+ *
+ * Each (source format, destination format) pair has its own row kernel,
+ * instantiated from one template, so plane count, chroma shifts, sample
+ * order and pixel size are constants of the inner loop. Kernels are found
+ * in a table built at compile time.
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <math.h>
+#include <stddef.h>
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+
+extern "C" {
+#include "libbpg.h"
+}
+
+#include "convert.hpp"
+#include "av_util.hpp"
+#include "looptask.hpp"
+#include "winthread.hpp"
+
+using namespace std;
+using namespace conv;
+
+
+/** Fixed point of kernels: samples are scaled to 12 bits, weights are Q13 */
+#define SAMPLE_BITS     12
+#define COEFF_BITS      13
+#define OUT_SHIFT       (SAMPLE_BITS - 8 + COEFF_BITS)
+#define OUT_ROUND       (1 << (OUT_SHIFT - 1))
+
+#define LUT_SIZE        (1 << SAMPLE_BITS)
+
+/** Rows of a subtask at least */
+#define MIN_ROWS_PER_TASK   16
+
+
+/**
+ * Conversion parameters of a (colour space, range, bit depth), see getCoeffs()
+ *
+ * Samples are first scaled to 12 bits, then looked up:
+ * - yLut: Y (or R, G, B of RGB colour space), offset & range applied, in Q13
+ * - cLut: chroma, centred & range applied
+ *
+ * RGB = Y + matrix x (U, V), matrix in Q13
+ */
+struct conv::Coeffs
+{
+    int lsh, rsh;               ///< Sample to 12-bit: (v << lsh) >> rsh
+    int rU, rV;
+    int gU, gV;
+    int bU, bV;
+    int yLut[LUT_SIZE];
+    int cLut[LUT_SIZE];
+};
+
+
+enum {
+    DST_RGB24,
+    DST_BGR24,
+    DST_RGBA,
+    DST_BGRA,
+    DST_GRAY8,
+};
+
+
+template <bool BE>
+static inline int load (const uint8_t *p, int i)
+{
+    return BE ? (p[2*i] << 8) | p[2*i+1] : p[2*i] | (p[2*i+1] << 8);
+}
+
+
+static inline uint8_t clip8 (int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+
+/**
+ * Row kernel
+ *
+ * Chroma is interpolated linearly with samples centred between luma ones,
+ * i.e. weights 3/4 and 1/4 of the nearest two on each subsampled axis.
+ */
+template <bool BE, int CW, int CH, bool ALPHA, bool RGB_SRC, int DST>
+static void convertRow (const Source &src, const Coeffs &k, int y, int x0, int x1, uint8_t *dst, int *tmp)
+{
+    enum {
+        BYTES = DST >= DST_RGBA ? 4 : 3,
+        R = (DST == DST_RGB24 || DST == DST_RGBA) ? 0 : 2,
+        B = 2 - R,
+    };
+    const uint8_t *p0 = src.data[0] + (ptrdiff_t)src.stride[0] * y;
+    const uint8_t *pa = ALPHA ? src.data[3] + (ptrdiff_t)src.stride[3] * y : NULL;
+
+    if (RGB_SRC)
+    {
+        /* GBR planes */
+        const uint8_t *pb = src.data[1] + (ptrdiff_t)src.stride[1] * y;
+        const uint8_t *pr = src.data[2] + (ptrdiff_t)src.stride[2] * y;
+
+        for (int x = x0; x < x1; x++, dst += BYTES)
+        {
+            int g = k.yLut[(load<BE> (p0, x) << k.lsh) >> k.rsh];
+            int b = k.yLut[(load<BE> (pb, x) << k.lsh) >> k.rsh];
+            int r = k.yLut[(load<BE> (pr, x) << k.lsh) >> k.rsh];
+
+            dst[R] = clip8 ((r + OUT_ROUND) >> OUT_SHIFT);
+            dst[1] = clip8 ((g + OUT_ROUND) >> OUT_SHIFT);
+            dst[B] = clip8 ((b + OUT_ROUND) >> OUT_SHIFT);
+            if (BYTES == 4)
+                dst[3] = ALPHA ? ((load<BE> (pa, x) << k.lsh) >> k.rsh) >> (SAMPLE_BITS - 8) : 255;
+        }
+        return;
+    }
+
+    int cw = (src.w + (1 << CW) - 1) >> CW;
+    int ch = (src.h + (1 << CH) - 1) >> CH;
+    int cx0 = max ((x0 >> CW) - CW, 0);
+    int cx1 = min (((x1 - 1) >> CW) + 1 + CW, cw);
+    int cy = y >> CH;
+    int cn = CH ? min (max (cy + ((y & 1) ? 1 : -1), 0), ch - 1) : cy;
+    int *tu = tmp;
+    int *tv = tmp + cw + 1;
+
+    /* Vertical interpolation, x4 */
+    {
+        const uint8_t *u0 = src.data[1] + (ptrdiff_t)src.stride[1] * cy;
+        const uint8_t *u1 = src.data[1] + (ptrdiff_t)src.stride[1] * cn;
+        const uint8_t *v0 = src.data[2] + (ptrdiff_t)src.stride[2] * cy;
+        const uint8_t *v1 = src.data[2] + (ptrdiff_t)src.stride[2] * cn;
+
+        for (int cx = cx0; cx < cx1; cx++)
+        {
+            int a = (load<BE> (u0, cx) << k.lsh) >> k.rsh;
+            int b = (load<BE> (v0, cx) << k.lsh) >> k.rsh;
+
+            if (CH)
+            {
+                tu[cx] = 3 * a + ((load<BE> (u1, cx) << k.lsh) >> k.rsh);
+                tv[cx] = 3 * b + ((load<BE> (v1, cx) << k.lsh) >> k.rsh);
+            }
+            else
+            {
+                tu[cx] = 4 * a;
+                tv[cx] = 4 * b;
+            }
+        }
+    }
+
+    for (int x = x0; x < x1; x++, dst += BYTES)
+    {
+        int cx = x >> CW;
+        int u, v, yv;
+
+        /* Horizontal interpolation, x16 in total */
+        if (CW)
+        {
+            int n = min (max (cx + ((x & 1) ? 1 : -1), 0), cw - 1);
+            u = 3 * tu[cx] + tu[n];
+            v = 3 * tv[cx] + tv[n];
+        }
+        else
+        {
+            u = 4 * tu[cx];
+            v = 4 * tv[cx];
+        }
+
+        u = k.cLut[(u + 8) >> 4];
+        v = k.cLut[(v + 8) >> 4];
+        yv = k.yLut[(load<BE> (p0, x) << k.lsh) >> k.rsh] + OUT_ROUND;
+
+        dst[R] = clip8 ((yv + k.rU * u + k.rV * v) >> OUT_SHIFT);
+        dst[1] = clip8 ((yv + k.gU * u + k.gV * v) >> OUT_SHIFT);
+        dst[B] = clip8 ((yv + k.bU * u + k.bV * v) >> OUT_SHIFT);
+        if (BYTES == 4)
+            dst[3] = ALPHA ? ((load<BE> (pa, x) << k.lsh) >> k.rsh) >> (SAMPLE_BITS - 8) : 255;
+    }
+}
+
+
+/**
+ * Row kernel of grayscale, whose 16-bit BE samples map to 8-bit by high byte
+ *
+ * Limited range is not applied, the same as sws::Context.
+ */
+template <int DST>
+static void grayRow (const Source &src, const Coeffs &k, int y, int x0, int x1, uint8_t *dst, int *tmp)
+{
+    enum {
+        BYTES = DST == DST_GRAY8 ? 1 : DST >= DST_RGBA ? 4 : 3,
+    };
+    const uint8_t *p0 = src.data[0] + (ptrdiff_t)src.stride[0] * y + 2 * x0;
+    int n = x1 - x0;
+
+    for (int x = 0; x < n; x++)
+    {
+        uint8_t v = p0[2*x];
+
+        dst[BYTES*x] = v;
+        if (BYTES >= 3)
+        {
+            dst[BYTES*x+1] = v;
+            dst[BYTES*x+2] = v;
+        }
+        if (BYTES == 4)
+            dst[BYTES*x+3] = 255;
+    }
+}
+
+
+/**
+ * Kernel table
+ */
+struct kernelEntry
+{
+    enum AVPixelFormat src_fmt;
+    enum AVPixelFormat dst_fmt;
+    RowFunc func;
+};
+
+#define KERNELS(fmt, BE, CW, CH, ALPHA, RGB_SRC) \
+    {fmt, AV_PIX_FMT_RGB24, convertRow<BE, CW, CH, ALPHA, RGB_SRC, DST_RGB24>}, \
+    {fmt, AV_PIX_FMT_BGR24, convertRow<BE, CW, CH, ALPHA, RGB_SRC, DST_BGR24>}, \
+    {fmt, AV_PIX_FMT_RGBA,  convertRow<BE, CW, CH, ALPHA, RGB_SRC, DST_RGBA>}, \
+    {fmt, AV_PIX_FMT_BGRA,  convertRow<BE, CW, CH, ALPHA, RGB_SRC, DST_BGRA>}
+
+static const kernelEntry kernels[] = {
+    {AV_PIX_FMT_GRAY16BE, AV_PIX_FMT_GRAY8, grayRow<DST_GRAY8>},
+    {AV_PIX_FMT_GRAY16BE, AV_PIX_FMT_RGB24, grayRow<DST_RGB24>},
+    {AV_PIX_FMT_GRAY16BE, AV_PIX_FMT_BGR24, grayRow<DST_RGB24>},
+    {AV_PIX_FMT_GRAY16BE, AV_PIX_FMT_RGBA,  grayRow<DST_RGBA>},
+    {AV_PIX_FMT_GRAY16BE, AV_PIX_FMT_BGRA,  grayRow<DST_RGBA>},
+
+    KERNELS (AV_PIX_FMT_GBRP16BE,       true,  0, 0, false, true),
+    KERNELS (AV_PIX_FMT_GBRAP16BE,      true,  0, 0, true,  true),
+
+    KERNELS (AV_PIX_FMT_YUV420P16BE,    true,  1, 1, false, false),
+    KERNELS (AV_PIX_FMT_YUV420P9LE,     false, 1, 1, false, false),
+    KERNELS (AV_PIX_FMT_YUV420P10LE,    false, 1, 1, false, false),
+    KERNELS (AV_PIX_FMT_YUV420P12LE,    false, 1, 1, false, false),
+    KERNELS (AV_PIX_FMT_YUV420P14LE,    false, 1, 1, false, false),
+    KERNELS (AV_PIX_FMT_YUVA420P16BE,   true,  1, 1, true,  false),
+    KERNELS (AV_PIX_FMT_YUVA420P9LE,    false, 1, 1, true,  false),
+    KERNELS (AV_PIX_FMT_YUVA420P10LE,   false, 1, 1, true,  false),
+
+    KERNELS (AV_PIX_FMT_YUV422P16BE,    true,  1, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV422P9LE,     false, 1, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV422P10LE,    false, 1, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV422P12LE,    false, 1, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV422P14LE,    false, 1, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUVA422P16BE,   true,  1, 0, true,  false),
+    KERNELS (AV_PIX_FMT_YUVA422P9LE,    false, 1, 0, true,  false),
+    KERNELS (AV_PIX_FMT_YUVA422P10LE,   false, 1, 0, true,  false),
+
+    KERNELS (AV_PIX_FMT_YUV444P16BE,    true,  0, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV444P9LE,     false, 0, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV444P10LE,    false, 0, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV444P12LE,    false, 0, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUV444P14LE,    false, 0, 0, false, false),
+    KERNELS (AV_PIX_FMT_YUVA444P16BE,   true,  0, 0, true,  false),
+    KERNELS (AV_PIX_FMT_YUVA444P9LE,    false, 0, 0, true,  false),
+    KERNELS (AV_PIX_FMT_YUVA444P10LE,   false, 0, 0, true,  false),
+};
+
+#undef KERNELS
+
+
+static RowFunc findKernel (enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt)
+{
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (kernels[i].src_fmt == src_fmt && kernels[i].dst_fmt == dst_fmt)
+            return kernels[i].func;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Fill conversion parameters
+ */
+static void initCoeffs (Coeffs &k, int color_space, bool limited_range, int depth)
+{
+    double kr, kb, kg;
+    double yOff = 0, ys = 1, cs = 1;
+    double m[3][2];
+
+    k.lsh = max (SAMPLE_BITS - depth, 0);
+    k.rsh = max (depth - SAMPLE_BITS, 0);
+
+    switch (color_space)
+    {
+    case BPG_CS_YCbCr_BT709:  kr = 0.2126; kb = 0.0722; break;
+    case BPG_CS_YCbCr_BT2020: kr = 0.2627; kb = 0.0593; break;
+    default:                  kr = 0.299;  kb = 0.114;  break;
+    }
+    kg = 1 - kr - kb;
+
+    if (color_space == BPG_CS_YCgCo)
+    {
+        /* U: Cg, V: Co */
+        m[0][0] = -1; m[0][1] =  1;
+        m[1][0] =  1; m[1][1] =  0;
+        m[2][0] = -1; m[2][1] = -1;
+    }
+    else
+    {
+        m[0][0] = 0;                        m[0][1] = 2 * (1 - kr);
+        m[1][0] = -2 * kb * (1 - kb) / kg;  m[1][1] = -2 * kr * (1 - kr) / kg;
+        m[2][0] = 2 * (1 - kb);             m[2][1] = 0;
+    }
+
+    /* (16, 235) of Y / RGB, (16, 240) of chroma -> (0, 255) */
+    if (limited_range)
+    {
+        yOff = 16 << (SAMPLE_BITS - 8);
+        ys = 255.0 / 219;
+        cs = 255.0 / 224;
+    }
+
+    k.rU = lrint (m[0][0] * (1 << COEFF_BITS));
+    k.rV = lrint (m[0][1] * (1 << COEFF_BITS));
+    k.gU = lrint (m[1][0] * (1 << COEFF_BITS));
+    k.gV = lrint (m[1][1] * (1 << COEFF_BITS));
+    k.bU = lrint (m[2][0] * (1 << COEFF_BITS));
+    k.bV = lrint (m[2][1] * (1 << COEFF_BITS));
+
+    for (int v = 0; v < LUT_SIZE; v++)
+    {
+        k.yLut[v] = lrint ((v - yOff) * ys * (1 << COEFF_BITS));
+        k.cLut[v] = lrint ((v - LUT_SIZE / 2) * cs);
+    }
+}
+
+
+/**
+ * Conversion parameters of a source, built once for each configuration
+ * and shared by all conversions
+ */
+static const Coeffs& getCoeffs (const Source &src)
+{
+    static winthread::mutex mtx;
+    static map<int, unique_ptr<Coeffs>> cache;
+
+    int depth = avutil::GetPixFmtDesc (src.fmt)->depth;
+    int key = (src.color_space << 8) | (src.limited_range << 7) | depth;
+    winthread::lock_guard _l(mtx);
+    unique_ptr<Coeffs> &k = cache[key];
+
+    if (!k)
+    {
+        k.reset (new Coeffs);
+        initCoeffs (*k, src.color_space, src.limited_range, depth);
+    }
+
+    return *k;
+}
+
+
+/**
+ * Conversion without scaling is supported, and quality is not beyond linear
+ * interpolation of chroma (grayscale / RGB have none, and swscale has no YCgCo);
+ * otherwise convert by sws::Context.
+ */
+bool conv::IsSupported (const Source &src, enum AVPixelFormat dst_fmt, int quality)
+{
+    if (quality >= 2 && !avutil::GetPixFmtDesc (src.fmt)->isRGB()
+        && src.fmt != AV_PIX_FMT_GRAY16BE && src.color_space != BPG_CS_YCgCo)
+        return false;
+
+    return findKernel (src.fmt, dst_fmt) != NULL;
+}
+
+
+namespace {
+
+class rowTask: public LoopTask
+{
+private:
+    RowFunc func;
+    const Source &src;
+    const Coeffs &k;
+    uint8_t *dst;
+    int dst_stride;
+    int x, w, y;
+
+public:
+    rowTask (RowFunc func, const Source &src, const Coeffs &k, uint8_t *dst, int dst_stride, int x, int w, int y):
+        func(func), src(src), k(k), dst(dst), dst_stride(dst_stride), x(x), w(w), y(y) {}
+
+    virtual void loop (int64_t begin, int64_t end, int64_t step) override
+    {
+        vector<int> tmp (2 * (src.w + 1));
+
+        for (int r = (int)begin; r < end && !IsCancelled(); r++)
+            func (src, k, r, x, x + w, dst + (ptrdiff_t)dst_stride * (r - y), &tmp[0]);
+    }
+};
+
+}
+
+
+/**
+ * Convert a rectangle of source into dst, without scaling
+ * @param dst   Buffer of the rectangle, pixel (x, y) at its top-left
+ * @return -1 if not supported or cancelled
+ */
+int conv::Convert (
+    ThreadPool &pool,
+    const Source &src,
+    enum AVPixelFormat dst_fmt,
+    uint8_t *dst, int dst_stride,
+    int x, int y, int w, int h,
+    const CancelToken *cancel
+)
+{
+    RowFunc func = findKernel (src.fmt, dst_fmt);
+
+    if (!func || x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > src.w || y + h > src.h)
+        return -1;
+
+    const Coeffs &k = getCoeffs (src);
+
+    LoopTaskManager tasks (pool);
+    tasks.SetLoopRange (y, y + h, 1, MIN_ROWS_PER_TASK);
+    tasks.SetCancelToken (cancel);
+    tasks.Dispatch<rowTask> (func, src, k, dst, dst_stride, x, w, y);
+    return tasks.IsCancelled() ? -1 : 0;
+}
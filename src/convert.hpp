@@ -0,0 +1,58 @@
+/**
+ * @file
+ * Direct conversion of BPG planes to RGB frames
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+#ifndef _CONVERT_HPP_
+#define _CONVERT_HPP_
+
+#include <stdint.h>
+
+extern "C" {
+#include "libavutil/pixfmt.h"
+}
+
+#include "threadpool.hpp"
+
+
+namespace conv {
+
+/**
+ * Decoded BPG image
+ */
+struct Source
+{
+    const uint8_t *data[4];     ///< Planes of the whole image
+    int stride[4];
+    enum AVPixelFormat fmt;     ///< BPG plane format, see ImageInfo::GetAVPixFmt()
+    int w, h;
+    int color_space;            ///< BPG_CS_*
+    bool limited_range;
+};
+
+
+struct Coeffs;
+
+
+/**
+ * Converts rows [y, y+1) of columns [x0, x1), specialized by source & destination format
+ * @param tmp   Scratch of 2 chroma rows, (w + 1) ints each
+ */
+typedef void (*RowFunc) (const Source &src, const Coeffs &k, int y, int x0, int x1, uint8_t *dst, int *tmp);
+
+
+bool IsSupported (const Source &src, enum AVPixelFormat dst_fmt, int quality);
+
+int Convert (
+    ThreadPool &pool,
+    const Source &src,
+    enum AVPixelFormat dst_fmt,
+    uint8_t *dst, int dst_stride,
+    int x, int y, int w, int h,
+    const CancelToken *cancel = NULL
+);
+
+}
+
+#endif /* _CONVERT_HPP_ */
@@ -0,0 +1,231 @@
+/**
+ * @file
+ * Asynchronous BPG decoding
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <stdio.h>
+#include <exception>
+#include <algorithm>
+
+#include "decode_job.hpp"
+#include "log.h"
+
+using namespace std;
+using namespace bpg;
+
+
+/**
+ * A decoder never taken is returned to pool
+ */
+DecodeJob::~DecodeJob()
+{
+    ReleaseDecoder (move (dec));
+}
+
+
+pDecodeJob DecodeJob::Start (ThreadPool &pool, const string &s_path, const DecodeSpec &spec, const Callback &cb)
+{
+    pDecodeJob job (new DecodeJob);
+
+    job->sPath = s_path;
+    job->spec = spec;
+    job->cb = cb;
+    job->task = PoolTask (pool, bind (&DecodeJob::run, job), spec.priority);
+    return job;
+}
+
+
+/**
+ * Decode from memory
+ * @param buf   BPG file content, moved into the job
+ */
+pDecodeJob DecodeJob::Start (ThreadPool &pool, vector<uint8_t> &&buf, const DecodeSpec &spec, const Callback &cb)
+{
+    pDecodeJob job (new DecodeJob);
+
+    job->data = move (buf);
+    job->spec = spec;
+    job->cb = cb;
+    job->task = PoolTask (pool, bind (&DecodeJob::run, job), spec.priority);
+    return job;
+}
+
+
+/**
+ * Read whole file
+ */
+void DecodeJob::load()
+{
+    pFILE fp (fopen (sPath.c_str(), "rb"), fclose);
+    FILE *_fp = fp.get();
+    long fsize;
+
+    if (!_fp)
+        throw runtime_error ("Cannot open file: " + sPath);
+
+    fseek (_fp, 0, SEEK_END);
+    fsize = ftell (_fp);
+    fseek (_fp, 0, SEEK_SET);
+
+    if (fsize <= 0)
+        throw runtime_error ("Empty file: " + sPath);
+
+    data.resize (fsize);
+    if ((size_t)fsize != fread (&data[0], 1, fsize, _fp))
+        throw runtime_error ("Failed to read file: " + sPath);
+}
+
+
+void DecodeJob::decode()
+{
+    int w, h;
+    int ret;
+
+    cancel.Check();
+
+    if (data.empty())
+        load();
+
+    dec = AcquireDecoder();
+    dec->SetCancelToken (cancel);
+    dec->DecodeBuffer (&data[0], data.size());
+    info = dec->GetInfo();
+
+    /* Input is not needed any more */
+    vector<uint8_t>().swap (data);
+
+    if (!spec.bConvert)
+        return;
+
+    /* Output size, keeping aspect ratio if one side is 0 */
+    w = spec.w;
+    h = spec.h;
+    if (w <= 0 && h <= 0)
+    {
+        w = info.width;
+        h = info.height;
+    }
+    else if (w <= 0)
+        w = max ((int)((int64_t)info.width * h / info.height), 1);
+    else if (h <= 0)
+        h = max ((int)((int64_t)info.height * w / info.width), 1);
+
+    if (spec.fmt == AV_PIX_FMT_NONE)
+        frame.AllocByBpp (w, h, info.GetBpp());
+    else
+        frame.AllocByFormat (w, h, spec.fmt);
+
+    if (w == (int)info.width && h == (int)info.height)
+        ret = dec->Convert (frame.fmt, frame.ptr, frame.stride, spec.quality);
+    else
+        ret = dec->Convert (frame.fmt, frame.ptr, frame.stride, w, h, spec.quality, spec.filter);
+
+    /* Decoded planes are not needed any more */
+    ReleaseDecoder (move (dec));
+
+    cancel.Check();
+    if (ret < 0)
+        throw runtime_error ("Conversion failed");
+}
+
+
+void DecodeJob::run()
+{
+    try {
+        decode();
+    }
+    catch (const Cancelled &e) {
+        sErr = e.what();
+        ReleaseDecoder (move (dec));
+        frame.Free();
+        Logi ("%s: %s\n", sPath.c_str(), e.what());
+    }
+    catch (const exception &e) {
+        sErr = e.what();
+        ReleaseDecoder (move (dec));
+        frame.Free();
+        Loge ("%s: %s\n", sPath.c_str(), e.what());
+    }
+
+    bReady = true;
+
+    if (cb)
+    {
+        cb (*this);
+        cb = nullptr;
+    }
+}
+
+
+void DecodeJob::Wait()
+{
+    if (!bReady)
+        task.Join();
+}
+
+
+bool DecodeJob::IsFailed()
+{
+    Wait();
+    return !sErr.empty();
+}
+
+
+const string& DecodeJob::GetError()
+{
+    Wait();
+    return sErr;
+}
+
+
+const ImageInfo& DecodeJob::GetInfo()
+{
+    Wait();
+    return info;
+}
+
+
+/**
+ * Get converted frame
+ * @throw runtime_error if decoding failed
+ */
+Frame& DecodeJob::GetFrame()
+{
+    Wait();
+
+    if (!sErr.empty())
+        throw runtime_error (sErr);
+
+    return frame;
+}
+
+
+/**
+ * Take decoder of a job started with DecodeSpec::bConvert = false
+ * @return NULL if decoding failed or already taken
+ */
+unique_ptr<Decoder> DecodeJob::TakeDecoder()
+{
+    Wait();
+    return move (dec);
+}
+
+
+/**
+ * Start decoding a file on #gThreadPool
+ */
+pDecodeJob bpg::DecodeAsync (const string &s_path, const DecodeSpec &spec, const DecodeJob::Callback &cb)
+{
+    return DecodeJob::Start (*gThreadPool, s_path, spec, cb);
+}
+
+
+/**
+ * Start decoding a buffer on #gThreadPool
+ */
+pDecodeJob bpg::DecodeAsync (vector<uint8_t> &&buf, const DecodeSpec &spec, const DecodeJob::Callback &cb)
+{
+    return DecodeJob::Start (*gThreadPool, move (buf), spec, cb);
+}
@@ -0,0 +1,121 @@
+/**
+ * @file
+ * Asynchronous BPG decoding
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+#ifndef _DECODE_JOB_HPP_
+#define _DECODE_JOB_HPP_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+
+#include "bpg_common.hpp"
+
+
+namespace bpg {
+
+/**
+ * Output of an asynchronous decode
+ */
+struct DecodeSpec
+{
+    enum AVPixelFormat fmt;     ///< Output format, AV_PIX_FMT_NONE to choose by image
+    int w, h;                   ///< Output size, 0 to keep aspect ratio / original size
+    int quality;
+    int filter;                 ///< sws::Context::FILTER_*
+    bool bConvert;              ///< false to keep decoded planes only, see DecodeJob::TakeDecoder()
+    int priority;               ///< ThreadPool::PRIO_*, inherited from the starting thread by default
+
+    DecodeSpec():
+        fmt(AV_PIX_FMT_NONE), w(0), h(0),
+        quality(-1), filter(sws::Context::FILTER_AUTO),
+        bConvert(true), priority(ThreadPool::GetCurrentPriority()) {}
+};
+
+
+class DecodeJob;
+typedef std::shared_ptr<DecodeJob> pDecodeJob;
+
+
+/**
+ * Handle of an image being read, decoded and converted on the thread pool
+ *
+ * Waiting on a job which is not started yet runs it on the waiting thread,
+ * so it is safe to wait from a worker thread.
+ */
+class DecodeJob
+{
+public:
+    /**
+     * Completion callback, called on the thread which ran the job.
+     * The job is complete, but it must not be waited in the callback.
+     */
+    typedef std::function<void(DecodeJob &job)> Callback;
+
+    static pDecodeJob Start (
+        ThreadPool &pool,
+        const std::string &s_path,
+        const DecodeSpec &spec,
+        const Callback &cb = nullptr
+    );
+
+    static pDecodeJob Start (
+        ThreadPool &pool,
+        std::vector<uint8_t> &&buf,
+        const DecodeSpec &spec,
+        const Callback &cb = nullptr
+    );
+
+    bool IsDone() const { return bReady; }
+    void Wait();
+
+    /** Give up the job, which fails with "cancelled" */
+    void Cancel() { cancel.Cancel(); }
+    bool IsCancelled() const { return cancel.IsCancelled(); }
+
+    bool IsFailed();
+    const std::string& GetError();
+    const ImageInfo& GetInfo();
+    Frame& GetFrame();
+    std::unique_ptr<Decoder> TakeDecoder();
+
+    const std::string& GetPath() const { return sPath; }
+
+private:
+    std::string sPath;
+    std::vector<uint8_t> data;
+    DecodeSpec spec;
+    Callback cb;
+    ImageInfo info;
+    std::unique_ptr<Decoder> dec;
+    Frame frame;
+    std::string sErr;
+    std::atomic<bool> bReady;
+    CancelToken cancel;
+    PoolTask task;
+
+    DecodeJob(): bReady(false) {}
+
+public:
+    ~DecodeJob();
+
+private:
+
+    void load();
+    void decode();
+    void run();
+};
+
+
+pDecodeJob DecodeAsync (const std::string &s_path, const DecodeSpec &spec, const DecodeJob::Callback &cb = nullptr);
+pDecodeJob DecodeAsync (std::vector<uint8_t> &&buf, const DecodeSpec &spec, const DecodeJob::Callback &cb = nullptr);
+
+} // namespace bpg
+
+#endif /* _DECODE_JOB_HPP_ */
@@ -1,6 +1,15 @@
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <exception>
 
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#include <sys/mman.h>
+#endif
+
 #include "frame.hpp"
 #include "bpg_common.hpp"
 
@@ -10,7 +19,7 @@ using namespace bpg;
 /**
  * Allocate buffer by bits-per-pixel
  */
-void Frame::AllocByBpp (int w, int h, int bpp)
+void Frame::AllocByBpp (int w, int h, int bpp, uint32_t align)
 {
     switch (bpp)
     {
@@ -20,51 +29,276 @@ void Frame::AllocByBpp (int w, int h, int bpp)
         default: throw runtime_error ("invalid format");
     }
 
-    AllocByFormat (w, h, fmt);
+    AllocByFormat (w, h, fmt, align);
 }
 
 
-void Frame::AllocByFormat (int w, int h, enum AVPixelFormat fmt)
+/**
+ * Allocate buffer by format
+ * @param align     Row alignment in bytes, 1 for packed rows
+ */
+void Frame::AllocByFormat (int w, int h, enum AVPixelFormat fmt, uint32_t align)
 {
     size_t bufsz;
 
-    SetFormat (w, h, fmt);
-    bufsz = stride * h;
-    buf = unique_ptr<uint8_t[]> (new uint8_t[bufsz]);
+    Free();
+    SetFormat (w, h, fmt, align);
+
+    /* Beyond size_t of 32-bit builds, with room for size class rounding */
+    if ((uint64_t)stride * h > SIZE_MAX / 2)
+        throw bad_alloc();
+
+    bufsz = GetSize();
+
+    if (gFramePool)
+    {
+        bufsz = FramePool::SizeClass (bufsz);
+        buf = unique_ptr<uint8_t, FrameDeleter> ((uint8_t*)gFramePool->Get (bufsz), FrameDeleter (gFramePool, bufsz));
+    }
+    else
+    {
+        buf = unique_ptr<uint8_t, FrameDeleter> ((uint8_t*)FramePool::SysAlloc (bufsz), FrameDeleter (NULL, bufsz));
+    }
+
     ptr = buf.get();
 }
 
 
-/**
- * Set frame format (stride will be calculated)
- */
-void FrameDesc::SetFormat (int w, int h, enum AVPixelFormat fmt)
+void Frame::Free()
 {
-    this->w = w;
-    this->h = h;
-    this->fmt = fmt;
+    buf.reset();
+    ptr = NULL;
+}
+
+
+void FrameDeleter::operator() (uint8_t *p) const
+{
+    if (pool)
+        pool->Put (p, size);
+    else
+        FramePool::SysFree (p, size);
+}
+
 
+uint32_t FrameDesc::GetBytesPerPixel (enum AVPixelFormat fmt)
+{
     switch (fmt)
     {
-        case AV_PIX_FMT_GRAY8: stride = w;     break;
+        case AV_PIX_FMT_GRAY8: return 1;
         case AV_PIX_FMT_RGB24:
-        case AV_PIX_FMT_BGR24: stride = w * 3; break;
+        case AV_PIX_FMT_BGR24: return 3;
         case AV_PIX_FMT_RGBA:
-        case AV_PIX_FMT_BGRA:  stride = w * 4; break;
+        case AV_PIX_FMT_BGRA:  return 4;
         default: throw runtime_error ("invalid format");
     }
 }
 
 
+/**
+ * Set frame format (stride will be calculated)
+ * @param align     Row alignment in bytes (power of 2)
+ */
+void FrameDesc::SetFormat (int w, int h, enum AVPixelFormat fmt, uint32_t align)
+{
+    uint64_t sz;
+
+    if (w < 0 || h < 0)
+        throw runtime_error ("invalid size");
+
+    sz = (uint64_t)w * GetBytesPerPixel (fmt);
+    sz = (sz + align - 1) & ~(uint64_t)(align - 1);
+
+    if (sz > INT_MAX)
+        throw runtime_error ("row too large");
+
+    this->w = w;
+    this->h = h;
+    this->fmt = fmt;
+    stride = sz;
+}
+
+
 void FrameDesc::GetLine (int y, void *dst) const
 {
-    memcpy (dst, (const uint8_t*)ptr + y * stride, stride);
+    memcpy (dst, (const uint8_t*)ptr + (size_t)y * stride, GetLineSize());
 }
 
 
 void FrameDesc::SetLine (int y, const void *src)
 {
-    uint8_t *dst = (uint8_t*)ptr + y * stride;
-    memcpy (dst, src, stride);
+    uint8_t *dst = (uint8_t*)ptr + (size_t)y * stride;
+    memcpy (dst, src, GetLineSize());
+}
+
+
+FramePool::FramePool (size_t cap, bool huge_pages):
+    cap(cap),
+    cached(0),
+    bHugePages(huge_pages)
+{
+}
+
+
+FramePool::~FramePool()
+{
+    Trim();
+}
+
+
+/**
+ * Round buffer size up to its size class
+ * Classes are 4 steps per power of 2, so at most 25% is wasted
+ */
+size_t FramePool::SizeClass (size_t size)
+{
+    size_t step = 4096;
+
+    if (size <= step)
+        return step;
+
+    while ((step << 3) < size)
+        step <<= 1;
+
+    return (size + step - 1) & ~(step - 1);
 }
 
+
+/**
+ * Get a buffer of #SizeClass() size, recycled if possible
+ */
+void* FramePool::Get (size_t size)
+{
+    {
+        winthread::lock_guard lock (mtx);
+
+        for (list<Block>::iterator it = freeList.begin(); it != freeList.end(); ++it)
+        {
+            if (it->size == size)
+            {
+                void *p = it->ptr;
+                cached -= size;
+                freeList.erase (it);
+                return p;
+            }
+        }
+    }
+
+    return SysAlloc (size, bHugePages);
+}
+
+
+/**
+ * Return a buffer to pool
+ * Least recently released buffers are freed if the cap is exceeded
+ */
+void FramePool::Put (void *p, size_t size)
+{
+    list<Block> evicted;
+
+    if (!p)
+        return;
+
+    {
+        winthread::lock_guard lock (mtx);
+        Block b = {p, size};
+
+        freeList.push_front (b);
+        cached += size;
+
+        while (cached > cap)
+        {
+            evicted.push_back (freeList.back());
+            cached -= freeList.back().size;
+            freeList.pop_back();
+        }
+    }
+
+    /* Free outside lock */
+    for (list<Block>::iterator it = evicted.begin(); it != evicted.end(); ++it)
+        SysFree (it->ptr, it->size, bHugePages);
+}
+
+
+/**
+ * Free all cached buffers
+ */
+void FramePool::Trim()
+{
+    list<Block> evicted;
+
+    {
+        winthread::lock_guard lock (mtx);
+        evicted.swap (freeList);
+        cached = 0;
+    }
+
+    for (list<Block>::iterator it = evicted.begin(); it != evicted.end(); ++it)
+        SysFree (it->ptr, it->size, bHugePages);
+}
+
+
+/**
+ * Allocate #ALIGN aligned buffer from system
+ * @param huge_pages    Back buffers of at least #HUGE_PAGE_MIN bytes by huge pages if possible
+ */
+void* FramePool::SysAlloc (size_t size, bool huge_pages)
+{
+    void *p;
+
+    if (huge_pages && size >= HUGE_PAGE_MIN)
+    {
+#ifdef _WIN32
+        /* Large pages need SeLockMemoryPrivilege, fall back to normal pages */
+        size_t lp = GetLargePageMinimum();
+        p = NULL;
+        if (lp)
+            p = VirtualAlloc (NULL, (size + lp - 1) & ~(lp - 1), MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (!p)
+            p = VirtualAlloc (NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+        p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            p = NULL;
+        else
+            madvise (p, size, MADV_HUGEPAGE);
+#endif
+    }
+    else
+    {
+#ifdef _WIN32
+        p = _aligned_malloc (size, ALIGN);
+#else
+        if (posix_memalign (&p, ALIGN, size))
+            p = NULL;
+#endif
+    }
+
+    if (!p)
+        throw bad_alloc();
+
+    return p;
+}
+
+
+void FramePool::SysFree (void *p, size_t size, bool huge_pages)
+{
+    if (!p)
+        return;
+
+    if (huge_pages && size >= HUGE_PAGE_MIN)
+    {
+#ifdef _WIN32
+        VirtualFree (p, 0, MEM_RELEASE);
+#else
+        munmap (p, size);
+#endif
+    }
+    else
+    {
+#ifdef _WIN32
+        _aligned_free (p);
+#else
+        free (p);
+#endif
+    }
+}
@@ -8,12 +8,15 @@
 #define _SRC_FRAME_HPP_
 
 #include <stdint.h>
+#include <stddef.h>
 
 extern "C" {
 #include "libavutil/pixfmt.h"
 }
 
 #include <memory>
+#include <list>
+#include "winthread.hpp"
 
 namespace bpg {
 
@@ -22,6 +25,9 @@ class ImageInfo;
 
 /**
  * Image frame descriptor
+ *
+ * A row fits in 31 bits (strides are int for swscale), while offsets of rows
+ * and buffer sizes are size_t, so frames larger than 4 GB are addressable.
  */
 class FrameDesc
 {
@@ -33,27 +39,88 @@ public:
 
     FrameDesc(): w(0), h(0), fmt(AV_PIX_FMT_NONE), ptr(NULL), stride(0) {}
 
-    void SetFormat (int w, int h, enum AVPixelFormat fmt);
+    void SetFormat (int w, int h, enum AVPixelFormat fmt, uint32_t align = 1);
 
     operator bool() const { return (bool)ptr; }
 
+    static uint32_t GetBytesPerPixel (enum AVPixelFormat fmt);
+    uint32_t GetLineSize() const { return w * GetBytesPerPixel (fmt); }
+    size_t GetSize() const { return (size_t)stride * h; }
+
     void GetLine (int y, void *dst) const;
     void SetLine (int y, const void *src);
 };
 
 
+/**
+ * Recycles frame buffers by size class, up to a memory cap
+ */
+class FramePool
+{
+private:
+    struct Block {
+        void *ptr;
+        size_t size;
+    };
+
+    winthread::mutex mtx;
+    std::list<Block> freeList;  ///< Most recently released first
+    size_t cap;                 ///< Max bytes kept in #freeList
+    size_t cached;              ///< Bytes kept in #freeList
+    bool bHugePages;
+
+public:
+    enum {
+        ALIGN = 64,                 ///< Buffer & row alignment
+        HUGE_PAGE_MIN = 16 << 20,   ///< Min buffer size to be backed by huge pages
+    };
+
+    FramePool (size_t cap = 256 << 20, bool huge_pages = false);
+    ~FramePool();
+
+    void* Get (size_t size);
+    void Put (void *p, size_t size);
+    void Trim();
+
+    size_t GetCached() const { return cached; }
+
+    static size_t SizeClass (size_t size);
+    static void* SysAlloc (size_t size, bool huge_pages = false);
+    static void SysFree (void *p, size_t size, bool huge_pages = false);
+};
+
+
+/**
+ * Returns frame buffer to the pool (or system if no pool)
+ */
+class FrameDeleter
+{
+private:
+    FramePool *pool;
+    size_t size;
+
+public:
+    FrameDeleter(): pool(NULL), size(0) {}
+    FrameDeleter (FramePool *pool, size_t size): pool(pool), size(size) {}
+
+    void operator() (uint8_t *p) const;
+};
+
+
 /**
  * Image frame buffer with auto-allocated buffer
+ * Rows are aligned to #FramePool::ALIGN by default
  */
 class Frame: public FrameDesc
 {
 private:
-    std::unique_ptr<uint8_t[]> buf;
+    std::unique_ptr<uint8_t, FrameDeleter> buf;
 
 public:
     Frame(){}
-    void AllocByBpp (int w, int h, int bpp);
-    void AllocByFormat (int w, int h, enum AVPixelFormat fmt);
+    void AllocByBpp (int w, int h, int bpp, uint32_t align = FramePool::ALIGN);
+    void AllocByFormat (int w, int h, enum AVPixelFormat fmt, uint32_t align = FramePool::ALIGN);
+    void Free();
 };
 
 }
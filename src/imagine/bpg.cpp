@@ -14,10 +14,14 @@ extern "C" {
 #include "log.h"
 
 #include <exception>
-#include "av_util.hpp"
+#include <vector>
 
 #define BPG_COMMON_SET
 #include "bpg_common.hpp"
+#include "animation.hpp"
+
+/** Interval of calling host's progress callback, which may abort loading */
+#define PROGRESS_POLL_MS    10
 
 #define _VERSION_NUMBER(a,b,c,d)     ((a<<24) | (b<<16) | (c<<8) | d)
 #define VERSION_NUMBER(abcd)      _VERSION_NUMBER (abcd)
@@ -58,6 +62,116 @@ static BOOL IMAGINEAPI checkFile (IMAGINEPLUGINFILEINFOTABLE *fileInfoTable,IMAG
 }
 
 
+/**
+ * Get bitmap pixel format by bits-per-pixel
+ */
+static enum AVPixelFormat get_dst_fmt (uint8_t bpp)
+{
+    switch (bpp)
+    {
+    case 8:  return AV_PIX_FMT_GRAY8;
+    case 24: return AV_PIX_FMT_BGR24;
+    case 32: return AV_PIX_FMT_BGRA;
+    default: throw runtime_error ("invalid bpp");
+    }
+}
+
+
+/**
+ * Run a loading step on thread pool, calling host's callback meanwhile
+ * @throw Cancelled if host aborts
+ */
+static void runStep (const function<void()> &fn, CancelToken &cancel, IMAGINELOADPARAM *loadParam, int current, int overall)
+{
+    IMAGINECALLBACK &cb = loadParam->callback;
+
+    if (!cb.proc)
+    {
+        fn();
+        return;
+    }
+
+    RunCancellable (*bpg::gThreadPool, fn, cancel, [&]() {
+        IMAGINECALLBACKPARAM param = {NULL, cb.param, current, overall, NULL};
+        return !cb.proc (&param);
+    }, PROGRESS_POLL_MS);
+}
+
+
+/**
+ * Destroy bitmaps of a partially loaded animation, last frame first
+ */
+static void destroyFrames (const IMAGINEPLUGININTERFACE *iface, vector<LPIMAGINEBITMAP> &bitmaps)
+{
+    while (!bitmaps.empty())
+    {
+        iface->lpVtbl->Destroy (bitmaps.back());
+        bitmaps.pop_back();
+    }
+}
+
+
+/**
+ * Load all frames of an animation, one bitmap per frame
+ * @return NULL if failed, no frame is kept
+ */
+static LPIMAGINEBITMAP loadAnimation (const IMAGINEPLUGININTERFACE *iface, IMAGINELOADPARAM *loadParam, int flags)
+{
+    bpg::AnimReader anim (*bpg::gThreadPool);
+    const bpg::AnimReader::Picture *pic;
+    vector<LPIMAGINEBITMAP> bitmaps;
+    bpg::ImageInfo hdr;
+
+    hdr.LoadFromBuffer (loadParam->buffer, loadParam->length);
+    anim.Open (loadParam->buffer, loadParam->length, get_dst_fmt (hdr.GetBpp()), -1, bpg::AnimReader::LOOP_ONCE);
+
+    const bpg::ImageInfo &info = anim.GetInfo();
+    uint8_t bpp = info.GetBpp();
+
+    try {
+        while ((pic = anim.GetFrame()))
+        {
+            LPIMAGINEBITMAP bitmap = iface->lpVtbl->Create (info.width, info.height, bpp, flags);
+            if (!bitmap)
+            {
+                destroyFrames (iface, bitmaps);
+                loadParam->errorCode = IMAGINEERROR_OUTOFMEMORY;
+                return NULL;
+            }
+
+            bitmaps.push_back (bitmap);
+
+            if (bpp == 8)
+                iface->lpVtbl->SetPalette (bitmap, get_gray_palette());
+
+            /* Bitmap is upside-down */
+            size_t linesz = iface->lpVtbl->GetWidthBytes (bitmap);
+            uint8_t *dst = (uint8_t*) iface->lpVtbl->GetBits (bitmap);
+
+            for (uint32_t y = 0; y < info.height; y++)
+                pic->frame.GetLine (y, dst + linesz * (info.height - 1 - y));
+
+            iface->lpVtbl->AnimSetDelay (bitmap, pic->duration);
+
+            if (bitmaps.size() > 1)
+                iface->lpVtbl->AnimAddFrame (bitmap, bitmaps[bitmaps.size() - 2]);
+        }
+    }
+    catch (...) {
+        destroyFrames (iface, bitmaps);
+        throw;
+    }
+
+    if (bitmaps.empty())
+    {
+        loadParam->errorCode = IMAGINEERROR_READERROR;
+        return NULL;
+    }
+
+    return bitmaps[0];
+}
+
+
 static LPIMAGINEBITMAP IMAGINEAPI loadFile(IMAGINEPLUGINFILEINFOTABLE *fileInfoTable,IMAGINELOADPARAM *loadParam,int flags)
 {
     const IMAGINEPLUGININTERFACE *iface = fileInfoTable->iface;
@@ -68,15 +182,28 @@ static LPIMAGINEBITMAP IMAGINEAPI loadFile(IMAGINEPLUGINFILEINFOTABLE *fileInfoT
         enum AVPixelFormat dst_fmt;
         uint8_t *dst;
         int dst_stride;
-        bpg::Decoder dec;
+        unique_ptr<bpg::Decoder> pdec = bpg::AcquireDecoder();
+        bpg::Decoder &dec = *pdec;
+        bpg::ImageInfo hdr;
+        CancelToken cancel;
+
+        dec.SetCancelToken (cancel);
+
+        /* Animation is decoded frame by frame */
+        hdr.LoadFromBuffer (loadParam->buffer, loadParam->length);
+        if (hdr.has_animation && !(flags & IMAGINELOADPARAM_GETINFO))
+            return loadAnimation (iface, loadParam, flags);
 
         if (flags & IMAGINELOADPARAM_GETINFO)
             dec.DecodeBuffer (loadParam->buffer, loadParam->length, bpg::Decoder::OPT_HEADER_ONLY);
         else
-            dec.DecodeBuffer (loadParam->buffer, loadParam->length);
+            runStep ([&]() { dec.DecodeBuffer (loadParam->buffer, loadParam->length); }, cancel, loadParam, 0, 2);
 
         const bpg::ImageInfo &info = dec.GetInfo();
         uint8_t bpp = info.GetBpp();
+
+        dst_fmt = get_dst_fmt (bpp);
+
         LPIMAGINEBITMAP bitmap = iface->lpVtbl->Create (info.width, info.height, bpp, flags);
         if (!bitmap)
         {
@@ -88,30 +215,31 @@ static LPIMAGINEBITMAP IMAGINEAPI loadFile(IMAGINEPLUGINFILEINFOTABLE *fileInfoT
             return bitmap;
 
         /* If grayscale, set palette */
-        switch (bpp)
-        {
-        case 8:
+        if (bpp == 8)
             iface->lpVtbl->SetPalette (bitmap, get_gray_palette());
-            dst_fmt = AV_PIX_FMT_GRAY8;
-            break;
-        case 24:
-            dst_fmt = AV_PIX_FMT_BGR24;
-            break;
-        case 32:
-            dst_fmt = AV_PIX_FMT_BGRA;
-            break;
-        default:
-            throw runtime_error ("invalid bpp");
-        }
 
         /* Bitmap is upside-down */
         size_t linesz = iface->lpVtbl->GetWidthBytes (bitmap);
         dst = (uint8_t*) iface->lpVtbl->GetBits (bitmap);
         dst += linesz * (info.height - 1);
         dst_stride = -linesz;
-        dec.Convert (dst_fmt, dst, dst_stride);
+
+        try {
+            runStep ([&]() { dec.Convert (dst_fmt, dst, dst_stride); }, cancel, loadParam, 1, 2);
+        }
+        catch (...) {
+            iface->lpVtbl->Destroy (bitmap);
+            throw;
+        }
+
+        bpg::ReleaseDecoder (move (pdec));
         return bitmap;
     }
+    catch (const Cancelled &e) {
+        Logi ("%s: aborted by host\n", __FUNCTION__);
+        loadParam->errorCode = IMAGINEERROR_ABORTED;
+        return NULL;
+    }
     catch (const exception &e) {
         Loge (e.what());
         loadParam->errorCode = IMAGINEERROR_READERROR;
@@ -160,13 +288,26 @@ EXTC BOOL CALLBACK APIENTRY DllMain(HINSTANCE hInstance,DWORD dwReason,LPVOID lp
     {
     case DLL_PROCESS_ATTACH :
         Logi ("Compiled at %s %s\n", __TIME__, __DATE__);
+        if (!bpg::IsCpuSupported())
+        {
+            Loge ("CPU does not support instruction set of libbpg\n");
+            return FALSE;
+        }
+
         bpg::gThreadPool = new ThreadPool;
-        avutil::init();
+        bpg::gFramePool = new bpg::FramePool (256 << 20, true);
+        bpg::gDecoderPool = new bpg::DecoderPool;
         break;
 
     case DLL_PROCESS_DETACH :
-        avutil::deinit();
+        /* Process exit: other threads are terminated, tasks they run never end */
+        if (lpvReserved)
+            break;
+
+        bpg::gThreadPool->Join();
         delete bpg::gThreadPool;
+        delete bpg::gDecoderPool;
+        delete bpg::gFramePool;
         break;
 
     case DLL_THREAD_ATTACH  :
@@ -6,14 +6,20 @@
  */
 
 
+#include <algorithm>
+
 #include "looptask.hpp"
 
 using namespace std;
 using namespace winthread;
 
 
+/** Chunks per core of background loops */
+#define BACKGROUND_SPLIT    4
+
 
-void LoopTaskManager::SetLoopRange (int begin, int end, int step, int minIterPerTask)
+
+void LoopTaskManager::SetLoopRange (int64_t begin, int64_t end, int64_t step, int64_t minIterPerTask)
 {
     this->begin = begin;
     this->end   = end;
@@ -23,18 +29,46 @@ void LoopTaskManager::SetLoopRange (int begin, int end, int step, int minIterPer
 
 
 /**
- * Thread procedure
+ * Claim and run one chunk
+ * @return false if all chunks are claimed
  */
-void LoopTaskManager::threadProc (LoopTask *ltask, int begin, int end, int step)
+bool LoopTaskManager::runChunk (const shared_ptr<chunks> &c)
 {
-    /* Execute loop, then report done */
-    if (ltask)
-        ltask->loop (begin, end, step);
+    int i;
+
+    {
+        lock_guard _l(c->mtx);
+
+        if (c->next >= (int)c->bounds.size() - 1)
+            return false;
+
+        i = c->next++;
+    }
+
+    if (!(c->cancel && c->cancel->IsCancelled()))
+        c->ltasks[i]->loop (c->bounds[i], c->bounds[i+1], c->step);
+
+    {
+        lock_guard _l(c->mtx);
+
+        if (--c->left == 0)
+            c->done.signal();
+    }
+
+    return true;
+}
 
-    lock_guard _l(mtx);
 
-    if (--waitCnt == 0)
-        cv.notify_one();
+/**
+ * Pool task running one chunk at a time
+ *
+ * It re-enqueues itself for the next chunk, so that higher priority tasks
+ * queued meanwhile run before it.
+ */
+void LoopTaskManager::poolProc (const shared_ptr<chunks> &c)
+{
+    if (runChunk (c))
+        c->pool->EnqueueTask (bind (&LoopTaskManager::poolProc, c), c->prio);
 }
 
 
@@ -43,7 +77,7 @@ void LoopTaskManager::threadProc (LoopTask *ltask, int begin, int end, int step)
  */
 int LoopTaskManager::calcOptTaskCnt() const
 {
-    uint8_t taskCnt = 1;
+    int taskCnt = 1;
 
     /* Get basic task count by number of processor cores */
     taskCnt = pool.GetNumOfProc();
@@ -51,15 +85,19 @@ int LoopTaskManager::calcOptTaskCnt() const
     if (taskCnt == 1) // Only 1 core available
         return 1;
 
+    /* Background loops in smaller chunks, which yield workers sooner */
+    if (ThreadPool::GetCurrentPriority() == ThreadPool::PRIO_BACKGROUND)
+        taskCnt *= BACKGROUND_SPLIT;
+
     /* Limit task count by min. iterations per task */
-    int iterCnt = (end - begin) / step; // Total iterations
-    int maxTaskCnt = iterCnt / minIter;
+    int64_t iterCnt = (end - begin) / step; // Total iterations
+    int64_t maxTaskCnt = iterCnt / minIter;
 
     if (maxTaskCnt == 0)
         maxTaskCnt = 1;
 
     if (taskCnt > maxTaskCnt)
-        taskCnt = maxTaskCnt;
+        taskCnt = (int)maxTaskCnt;
 
     return taskCnt;
 }
@@ -68,45 +106,46 @@ int LoopTaskManager::calcOptTaskCnt() const
 /**
  * Calculate the ending index of the loop
  */
-int LoopTaskManager::calcEndingIdx() const
+int64_t LoopTaskManager::calcEndingIdx() const
 {
     return begin + ((end - begin + step-1) / step) * step;
 }
 
 
 /**
- * Wait all inner task is done
+ * Run chunks on pool and wait all of them are done
+ *
+ * The dispatching thread runs chunks as well, so chunks never wait for a
+ * busy pool, e.g. when dispatched from a worker thread.
  */
-void LoopTaskManager::dispatchTasks (LoopTask* const ltasks[])
+void LoopTaskManager::dispatchTasks (LoopTask* const ltasks[], int taskCnt)
 {
-    size_t procCnt = pool.GetNumOfProc();
-    function<void()> itasks[procCnt];
-
-    int loopCnt = (end - begin) / step;
-    int loopPerProc = loopCnt / procCnt;
-    int begin2 = begin, end2;
-
-    /* Create inner tasks */
-    for (size_t i = 0; i < procCnt; i++)
+    shared_ptr<chunks> c = make_shared<chunks>();
+    int64_t loopCnt = (end - begin + step - 1) / step;
+    int64_t b = begin;
+
+    c->ltasks = ltasks;
+    c->step = step;
+    c->next = 0;
+    c->left = taskCnt;
+    c->pool = &pool;
+    c->prio = ThreadPool::GetCurrentPriority();
+    c->cancel = cancel;
+    c->bounds.resize (taskCnt + 1);
+
+    /* Split evenly */
+    for (int i = 0; i < taskCnt; i++)
     {
-        if (i == procCnt-1) // Last task
-            end2 = end;
-        else
-            end2 = begin + loopPerProc * step;
-
-        itasks[i] = bind (&threadProc, this, ltasks[i], begin2, end2, step);
-        begin2 = end2;
+        c->bounds[i] = b;
+        b += (loopCnt / taskCnt + (i < loopCnt % taskCnt)) * step;
     }
+    c->bounds[taskCnt] = end;
 
-    waitCnt = procCnt;
-
-    /* Wait until all tasks are done */
-    {
-        lock_guard _l(mtx);
-
-        for (size_t i = 0; i < procCnt; i++)
-            pool.EnqueueTask (itasks[i]);
+    /* Chunks more than cores are run by re-enqueued pool tasks */
+    for (int i = 1; i < min (taskCnt, (int)pool.GetNumOfProc()); i++)
+        pool.EnqueueTask (bind (&LoopTaskManager::poolProc, c), c->prio);
 
-        cv.wait (mtx);
-    }
+    while (runChunk (c))
+        ;
+    c->done.wait();
 }
@@ -8,6 +8,10 @@
 #define _LOOPTASK_HPP_
 
 
+#include <stdint.h>
+
+#include <vector>
+#include <memory>
 #include "threadpool.hpp"
 
 
@@ -16,11 +20,18 @@
  */
 struct LoopTask
 {
+    const CancelToken *cancel;  ///< Set by LoopTaskManager, may be NULL
+
+    LoopTask(): cancel(NULL) {}
     virtual ~LoopTask(){}
     /**
      * Loop context, which ranges from [begin, end)
+     * Indices are 64-bit, so loops over pixels / bytes of huge images do not overflow.
+     * Long loops shall return early if IsCancelled().
      */
-    virtual void loop (int begin, int end, int step) = 0;
+    virtual void loop (int64_t begin, int64_t end, int64_t step) = 0;
+
+    bool IsCancelled() const { return cancel && cancel->IsCancelled(); }
 };
 
 
@@ -30,27 +41,47 @@ struct LoopTask
 class LoopTaskManager
 {
 private:
-    winthread::mutex mtx;
-    winthread::cond_var cv;
-    ThreadPool &pool;
-    int begin;
-    int end;
-    int step;
-    int minIter;        ///< Minimum iterations per task
+    /**
+     * Loop chunks, claimed one by one by pool tasks and the dispatching thread.
+     * Shared with pool tasks, which may outlive Dispatch().
+     */
+    struct chunks {
+        winthread::mutex mtx;
+        winthread::event done;
+        LoopTask* const *ltasks;
+        std::vector<int64_t> bounds;    ///< Chunk i is [bounds[i], bounds[i+1])
+        int64_t step;
+        int next;                   ///< Next chunk to be claimed
+        int left;                   ///< Unfinished chunks
+        ThreadPool *pool;
+        int prio;                   ///< Priority of pool tasks
+        const CancelToken *cancel;
+
+        chunks(): done (winthread::event::OPT_MANUAL_RESET) {}
+    };
 
-    volatile uint8_t waitCnt;
+    ThreadPool &pool;
+    int64_t begin;
+    int64_t end;
+    int64_t step;
+    int64_t minIter;    ///< Minimum iterations per task
+    const CancelToken *cancel;
 
     int calcOptTaskCnt() const;
-    int calcEndingIdx() const;
-    void dispatchTasks (LoopTask* const ltasks[]);
-    void threadProc (LoopTask *ltask, int begin, int end, int step);
+    int64_t calcEndingIdx() const;
+    void dispatchTasks (LoopTask* const ltasks[], int taskCnt);
+    static bool runChunk (const std::shared_ptr<chunks> &c);
+    static void poolProc (const std::shared_ptr<chunks> &c);
 
 public:
     LoopTaskManager (ThreadPool &pool):
-        pool(pool), begin(0), end(0), step(0), minIter(0),
-        waitCnt(0) {}
+        pool(pool), begin(0), end(0), step(0), minIter(0), cancel(NULL) {}
+
+    void SetLoopRange (int64_t begin, int64_t end, int64_t step = 1, int64_t minIterPerTask = 1);
 
-    void SetLoopRange (int begin, int end, int step = 1, int minIterPerTask = 1);
+    /** Chunks not started yet are skipped once cancelled */
+    void SetCancelToken (const CancelToken *cancel) { this->cancel = cancel; }
+    bool IsCancelled() const { return cancel && cancel->IsCancelled(); }
 
     /**
      * Create tasks, run and wait all task end
@@ -59,24 +90,28 @@ public:
      * @return Ending index of loops
      */
     template <class TASK, typename... Args>
-    int Dispatch (Args&&... args) {
-        uint8_t taskCnt = calcOptTaskCnt();
+    int64_t Dispatch (Args&&... args) {
+        int taskCnt = calcOptTaskCnt();
 
         if (taskCnt == 1) // Single-thread
         {
             TASK ltask (args...);
+            ltask.cancel = cancel;
             ltask.loop (begin, end, step);
         }
         else // Multi-thread
         {
             LoopTask *ltasks[taskCnt];
 
-            for (size_t i = 0; i < taskCnt; i++)
+            for (int i = 0; i < taskCnt; i++)
+            {
                 ltasks[i] = new TASK (args...);
+                ltasks[i]->cancel = cancel;
+            }
 
-            dispatchTasks (ltasks);
+            dispatchTasks (ltasks, taskCnt);
 
-            for (size_t i = 0; i < taskCnt; i++)
+            for (int i = 0; i < taskCnt; i++)
                 delete ltasks[i];
         }
 
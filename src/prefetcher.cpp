@@ -0,0 +1,391 @@
+/**
+ * @file
+ * Directory read-ahead for viewer navigation
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+#include <algorithm>
+
+#include "prefetcher.hpp"
+#include "log.h"
+
+using namespace std;
+using namespace bpg;
+
+
+/** Bytes read to parse a header, enough for usual extension data */
+#define HEADER_PROBE_BYTES  (64 << 10)
+
+
+static bool nameLess (const string &a, const string &b)
+{
+    return _stricmp (a.c_str(), b.c_str()) < 0;
+}
+
+
+static int get_opt (const char s_opt[], const char s_fmt[], int *val)
+{
+    /* Option name is the format before the first space */
+    const char *s = strstr (s_opt, string (s_fmt, strcspn (s_fmt, " ")).c_str());
+
+    if (!s)
+        return 0;
+
+    return sscanf (s, s_fmt, val);
+}
+
+
+/**
+ * Parse "-n <next files> -p <previous files> -m <memory in MB>"
+ */
+void Prefetcher::Config::Parse (const char s_opt[])
+{
+    int mb;
+
+    get_opt (s_opt, "-n %d", &ahead);
+    get_opt (s_opt, "-p %d", &behind);
+    if (get_opt (s_opt, "-m %d", &mb) && mb > 0)
+        maxBytes = (size_t)mb << 20;
+
+    ahead = max (ahead, 0);
+    behind = max (behind, 0);
+
+    Logi ("prefetch: -n %d -p %d -m %u\n", ahead, behind, (unsigned)(maxBytes >> 20));
+}
+
+
+Prefetcher::Prefetcher (ThreadPool &pool):
+    pool(pool)
+{
+}
+
+
+/**
+ * Cancel all jobs and wait for them, they use the pools of decoders / frames
+ */
+Prefetcher::~Prefetcher()
+{
+    for (list<Entry>::iterator it = cache.begin(); it != cache.end(); ++it)
+        it->job->Cancel();
+
+    for (list<Entry>::iterator it = cache.begin(); it != cache.end(); ++it)
+        it->job->Wait();
+}
+
+
+void Prefetcher::SetConfig (const Config &cfg)
+{
+    winthread::lock_guard _l(mtx);
+    this->cfg = cfg;
+}
+
+
+/**
+ * Memory of decoded planes (16-bit samples)
+ */
+size_t Prefetcher::estimateBytes (const ImageInfo &info)
+{
+    size_t pixels = (size_t)info.width * info.height;
+    size_t samples;
+
+    switch (info.format)
+    {
+    case BPG_FORMAT_GRAY:       samples = pixels;         break;
+    case BPG_FORMAT_420:
+    case BPG_FORMAT_420_VIDEO:  samples = pixels * 3 / 2; break;
+    case BPG_FORMAT_422:
+    case BPG_FORMAT_422_VIDEO:  samples = pixels * 2;     break;
+    default:                    samples = pixels * 3;     break;
+    }
+
+    if (info.has_alpha)
+        samples += pixels;
+
+    return samples * 2;
+}
+
+
+/**
+ * Parse header of a file, without reading the whole file
+ * @return false if not readable
+ */
+bool Prefetcher::readInfo (const string &s_path, ImageInfo &info)
+{
+    pFILE fp (fopen (s_path.c_str(), "rb"), fclose);
+    vector<uint8_t> buf (HEADER_PROBE_BYTES);
+    size_t len;
+
+    if (!fp)
+        return false;
+
+    len = fread (&buf[0], 1, buf.size(), fp.get());
+    if (!ImageInfo::CheckHeader (&buf[0], len))
+        return false;
+
+    try {
+        info.LoadFromBuffer (&buf[0], len);
+    }
+    catch (const exception &e) {
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * List BPG files of a directory in name order
+ */
+void Prefetcher::listDir (const string &s_dir)
+{
+    WIN32_FIND_DATAA fd;
+    string s_pattern = s_dir + "\\*." FORMAT_EXT;
+    HANDLE h;
+
+    sDir = s_dir;
+    files.clear();
+
+    h = FindFirstFileA (s_pattern.c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+
+    do {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            files.push_back (fd.cFileName);
+    } while (FindNextFileA (h, &fd));
+    FindClose (h);
+
+    sort (files.begin(), files.end(), nameLess);
+}
+
+
+int Prefetcher::findFile (const string &s_name) const
+{
+    vector<string>::const_iterator it = lower_bound (files.begin(), files.end(), s_name, nameLess);
+
+    if (it == files.end() || _stricmp (it->c_str(), s_name.c_str()))
+        return -1;
+
+    return it - files.begin();
+}
+
+
+/**
+ * Drop entries out of range of current file, then farthest ones until
+ * memory limit is met
+ *
+ * Entries being decoded count as well, by the size estimated from their
+ * headers; farthest ones are cancelled first.
+ * @return Estimated memory of entries kept
+ */
+size_t Prefetcher::trim (int cur)
+{
+    size_t bytes = 0;
+
+    for (list<Entry>::iterator it = cache.begin(); it != cache.end();)
+    {
+        /* Entries are always in sDir */
+        int idx = findFile (it->sPath.substr (sDir.size() + 1));
+        int d = idx - cur;
+
+        if (idx < 0 || d == 0 || d > cfg.ahead || -d > cfg.behind)
+        {
+            /* Viewer went elsewhere, release the pool */
+            it->job->Cancel();
+            it = cache.erase (it);
+            continue;
+        }
+
+        /* Kept, so that it is not started again */
+        if (it->job->IsDone() && it->job->IsFailed())
+            it->bytes = 0;
+
+        it->idx = idx;
+        bytes += it->bytes;
+        ++it;
+    }
+
+    while (bytes > cfg.maxBytes)
+    {
+        list<Entry>::iterator far = cache.end();
+
+        for (list<Entry>::iterator it = cache.begin(); it != cache.end(); ++it)
+        {
+            if (!it->bytes)
+                continue;
+            if (far == cache.end() || abs (it->idx - cur) > abs (far->idx - cur))
+                far = it;
+        }
+
+        bytes -= far->bytes;
+        far->job->Cancel();
+        cache.erase (far);
+    }
+
+    return bytes;
+}
+
+
+/**
+ * Take prefetched decoder of a file, waiting if it is still being decoded
+ * @return NULL if not prefetched or failed
+ */
+unique_ptr<Decoder> Prefetcher::Take (const string &s_path)
+{
+    pDecodeJob job;
+
+    {
+        winthread::lock_guard _l(mtx);
+
+        for (list<Entry>::iterator it = cache.begin(); it != cache.end(); ++it)
+        {
+            if (0 == _stricmp (it->sPath.c_str(), s_path.c_str()))
+            {
+                job = it->job;
+                cache.erase (it);
+                break;
+            }
+        }
+    }
+
+    if (!job)
+        return nullptr;
+
+    Logi ("%s: hit %s\n", __FUNCTION__, s_path.c_str());
+    return job->TakeDecoder();
+}
+
+
+/**
+ * Prefetch neighbours of a file being viewed
+ *
+ * Nothing is prefetched by a single-thread pool, which would decode them
+ * on this thread. Jobs are started out of the lock, since a busy pool may
+ * run them on the calling thread as well.
+ *
+ * Files are started nearest first, until the next one does not fit in the
+ * memory limit with the cached ones. Entries dropped by trim() for memory
+ * are the farthest ones and did not fit either, so they are not started
+ * again until nearer ones leave.
+ */
+void Prefetcher::Schedule (const string &s_path)
+{
+    vector<Entry> cands, starts;
+    DecodeSpec spec;
+    size_t pos;
+    size_t bytes, maxBytes;
+    string s_dir, s_name;
+
+    if (pool.GetNumOfProc() <= 1)
+        return;
+
+    pos = s_path.find_last_of ("\\/");
+    if (pos == string::npos)
+        return;
+
+    s_dir = s_path.substr (0, pos);
+    s_name = s_path.substr (pos + 1);
+
+    {
+        winthread::lock_guard _l(mtx);
+        int cur;
+
+        if (!cfg.IsEnabled())
+            return;
+
+        /* Another directory */
+        if (_stricmp (s_dir.c_str(), sDir.c_str()))
+        {
+            for (list<Entry>::iterator it = cache.begin(); it != cache.end(); ++it)
+                it->job->Cancel();
+            cache.clear();
+            listDir (s_dir);
+        }
+
+        /* Maybe a new file */
+        cur = findFile (s_name);
+        if (cur < 0)
+        {
+            listDir (s_dir);
+            cur = findFile (s_name);
+            if (cur < 0)
+                return;
+        }
+
+        bytes = trim (cur);
+        maxBytes = cfg.maxBytes;
+
+        /* Nearest first, forward first */
+        for (int d = 1; d <= max (cfg.ahead, cfg.behind); d++)
+        {
+            int idx[2] = {
+                d <= cfg.ahead  ? cur + d : -1,
+                d <= cfg.behind ? cur - d : -1,
+            };
+
+            for (int i = 0; i < 2; i++)
+            {
+                bool cached = false;
+                Entry e;
+
+                if (idx[i] < 0 || idx[i] >= (int)files.size())
+                    continue;
+
+                for (list<Entry>::iterator it = cache.begin(); it != cache.end(); ++it)
+                    cached = cached || it->idx == idx[i];
+                if (cached)
+                    continue;
+
+                e.sPath = sDir + "\\" + files[idx[i]];
+                e.idx = idx[i];
+                e.bytes = 0;
+                cands.push_back (e);
+            }
+        }
+    }
+
+    /* Headers are read out of the lock as well */
+    for (size_t i = 0; i < cands.size(); i++)
+    {
+        ImageInfo info;
+
+        if (!readInfo (cands[i].sPath, info))
+            continue;
+
+        cands[i].bytes = estimateBytes (info);
+        if (bytes + cands[i].bytes > maxBytes)
+            break;
+
+        bytes += cands[i].bytes;
+        starts.push_back (cands[i]);
+    }
+
+    spec.bConvert = false;
+    spec.priority = ThreadPool::PRIO_BACKGROUND;
+
+    for (size_t i = 0; i < starts.size(); i++)
+        starts[i].job = DecodeJob::Start (pool, starts[i].sPath, spec);
+
+    {
+        winthread::lock_guard _l(mtx);
+
+        for (size_t i = 0; i < starts.size(); i++)
+        {
+            bool keep = !_stricmp (s_dir.c_str(), sDir.c_str());
+
+            /* Scheduled by another call meanwhile */
+            for (list<Entry>::iterator it = cache.begin(); keep && it != cache.end(); ++it)
+                keep = _stricmp (it->sPath.c_str(), starts[i].sPath.c_str()) != 0;
+
+            if (keep)
+                cache.push_back (starts[i]);
+            else
+                starts[i].job->Cancel();
+        }
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * @file
+ * Directory read-ahead for viewer navigation
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+#ifndef _PREFETCHER_HPP_
+#define _PREFETCHER_HPP_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+
+#include "decode_job.hpp"
+
+
+namespace bpg {
+
+/**
+ * Decodes the neighbours of the image being viewed in background
+ *
+ * When an image is opened, the next / previous files of its directory (in
+ * name order) are decoded on the thread pool into a bounded cache, so that
+ * stepping to them takes the decoded image instead of decoding it again.
+ */
+class Prefetcher
+{
+public:
+    struct Config
+    {
+        int ahead;          ///< Number of next files
+        int behind;         ///< Number of previous files
+        size_t maxBytes;    ///< Max memory of decoded images
+
+        Config(): ahead(0), behind(0), maxBytes(256 << 20) {}
+
+        bool IsEnabled() const { return ahead > 0 || behind > 0; }
+        void Parse (const char s_opt[]);
+    };
+
+    Prefetcher (ThreadPool &pool);
+    ~Prefetcher();
+
+    void SetConfig (const Config &cfg);
+    const Config& GetConfig() const { return cfg; }
+
+    std::unique_ptr<Decoder> Take (const std::string &s_path);
+    void Schedule (const std::string &s_path);
+
+private:
+    struct Entry
+    {
+        std::string sPath;
+        int idx;                ///< Index in directory
+        size_t bytes;           ///< Estimated memory of decoded image, from header
+        pDecodeJob job;
+    };
+
+    ThreadPool &pool;
+    Config cfg;
+    winthread::mutex mtx;
+    std::list<Entry> cache;
+    std::string sDir;
+    std::vector<std::string> files;     ///< Sorted file names of sDir
+
+    void listDir (const std::string &s_dir);
+    int findFile (const std::string &s_name) const;
+    size_t trim (int cur);
+
+    static size_t estimateBytes (const ImageInfo &info);
+    static bool readInfo (const std::string &s_path, ImageInfo &info);
+};
+
+} // namespace bpg
+
+#endif /* _PREFETCHER_HPP_ */
@@ -0,0 +1,226 @@
+/**
+ * @file
+ * Multi-resolution renditions of a decoded image
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <string.h>
+#include <exception>
+#include <algorithm>
+
+#include "pyramid.hpp"
+#include "looptask.hpp"
+#include "benchmark.hpp"
+#include "log.h"
+
+using namespace std;
+using namespace bpg;
+
+
+/** Level-0 rows per band */
+#define BAND_ROWS   64
+
+
+Pyramid::Pyramid (ThreadPool &pool):
+    pool(pool)
+{
+}
+
+
+void Pyramid::GetLevelSize (int w, int h, int level, int &lw, int &lh)
+{
+    lw = (w + (1 << level) - 1) >> level;
+    lh = (h + (1 << level) - 1) >> level;
+}
+
+
+/**
+ * Fit image into thumb_size x thumb_size, keeping aspect ratio
+ * Images smaller than that are not enlarged.
+ */
+void Pyramid::GetThumbnailSize (int w, int h, int thumb_size, int &tw, int &th)
+{
+    if (w <= thumb_size && h <= thumb_size)
+    {
+        tw = w;
+        th = h;
+    }
+    else if (w >= h)
+    {
+        tw = thumb_size;
+        th = max ((int)((int64_t)h * thumb_size / w), 1);
+    }
+    else
+    {
+        th = thumb_size;
+        tw = max ((int)((int64_t)w * thumb_size / h), 1);
+    }
+}
+
+
+/**
+ * 2x2 box filter of a row, the last column / row is repeated if size is odd
+ */
+static void boxRow (uint8_t *dst, const uint8_t *s0, const uint8_t *s1, int sw, int dw, int bpp)
+{
+    for (int x = 0; x < dw; x++, dst += bpp)
+    {
+        const uint8_t *a = s0 + bpp * 2 * x;
+        const uint8_t *b = s1 + bpp * 2 * x;
+        int next = (2 * x + 1 < sw) ? bpp : 0;
+
+        for (int c = 0; c < bpp; c++)
+            dst[c] = (a[c] + a[c + next] + b[c] + b[c + next] + 2) >> 2;
+    }
+}
+
+
+/**
+ * Box filter all lower levels of a band
+ *
+ * Loop index is row of the lowest level; row r of it covers rows
+ * [r << k, (r + 1) << k) of the level k levels above.
+ */
+class Pyramid::boxTask: public LoopTask
+{
+private:
+    FrameDesc *dst;
+    int levels;
+
+public:
+    boxTask (FrameDesc *dst, int levels): dst(dst), levels(levels) {}
+
+    virtual void loop (int64_t begin, int64_t end, int64_t step) override
+    {
+        int bpp = FrameDesc::GetBytesPerPixel (dst[0].fmt);
+
+        for (int i = 1; i < levels; i++)
+        {
+            const FrameDesc &s = dst[i-1];
+            const FrameDesc &d = dst[i];
+            int shift = levels - 1 - i;
+            int r1 = (int)min<int64_t> (end << shift, d.h);
+
+            for (int r = (int)(begin << shift); r < r1 && !IsCancelled(); r++)
+            {
+                const uint8_t *s0 = (const uint8_t*)s.ptr + (size_t)s.stride * (2 * r);
+                const uint8_t *s1 = (const uint8_t*)s.ptr + (size_t)s.stride * min (2 * r + 1, (int)s.h - 1);
+
+                boxRow ((uint8_t*)d.ptr + (size_t)d.stride * r, s0, s1, s.w, d.w, bpp);
+            }
+        }
+    }
+};
+
+
+/**
+ * Build pyramid into own frames
+ * @param thumb_size    Bounding size of thumbnail, 0 for no thumbnail
+ */
+void Pyramid::Build (Decoder &dec, enum AVPixelFormat fmt, int levels, int thumb_size, int quality)
+{
+    const ImageInfo &info = dec.GetInfo();
+    FrameDesc dst[MAX_LEVELS];
+    FrameDesc dthumb;
+
+    levels = max (1, min (levels, (int)MAX_LEVELS));
+    frames.resize (levels);
+
+    for (int i = 0; i < levels; i++)
+    {
+        int lw, lh;
+
+        GetLevelSize (info.width, info.height, i, lw, lh);
+        frames[i].AllocByFormat (lw, lh, fmt);
+        dst[i] = frames[i];
+    }
+
+    if (thumb_size > 0)
+    {
+        int tw, th;
+
+        GetThumbnailSize (info.width, info.height, thumb_size, tw, th);
+        thumb.AllocByFormat (tw, th, fmt);
+        dthumb = thumb;
+    }
+    else
+    {
+        thumb.Free();
+    }
+
+    Build (dec, dst, levels, thumb_size > 0 ? &dthumb : NULL, quality);
+}
+
+
+/**
+ * Build pyramid into caller-provided buffers
+ * @param dst       Levels, sized by GetLevelSize()
+ * @param thumb     Thumbnail of any size not larger than level 0, or NULL
+ * @throw Cancelled if cancelled by token of decoder
+ */
+void Pyramid::Build (Decoder &dec, FrameDesc dst[], int levels, FrameDesc *thumb, int quality)
+{
+    Benchmark bm ("BPG pyramid");
+    const ImageInfo &info = dec.GetInfo();
+    const CancelToken &cancel = dec.GetCancelToken();
+
+    if (levels < 1 || levels > MAX_LEVELS)
+        throw runtime_error ("invalid number of levels");
+
+    for (int i = 0; i < levels; i++)
+    {
+        int lw, lh;
+
+        GetLevelSize (info.width, info.height, i, lw, lh);
+        if (dst[i].w != (uint32_t)lw || dst[i].h != (uint32_t)lh || dst[i].fmt != dst[0].fmt || !dst[i])
+            throw runtime_error ("invalid level buffer");
+    }
+
+    /* The only pass over decoded planes */
+    if (dec.Convert (dst[0].fmt, dst[0].ptr, dst[0].stride, quality) < 0)
+    {
+        cancel.Check();
+        throw runtime_error ("conversion failed");
+    }
+
+    if (levels > 1)
+    {
+        LoopTaskManager tasks (pool);
+        tasks.SetLoopRange (0, dst[levels-1].h, 1, max (BAND_ROWS >> (levels - 1), 1));
+        tasks.SetCancelToken (&cancel);
+        tasks.Dispatch<boxTask> (dst, levels);
+        cancel.Check();
+    }
+
+    if (thumb)
+    {
+        sws::Context swsCtx;
+        const FrameDesc *src = &dst[0];
+        const uint8_t *src_ptr;
+        int src_stride;
+        uint8_t *dst_ptr;
+        int dst_stride;
+
+        if (thumb->fmt != dst[0].fmt || !*thumb || thumb->w > dst[0].w || thumb->h > dst[0].h)
+            throw runtime_error ("invalid thumbnail buffer");
+
+        /* Smallest level still covering the thumbnail */
+        for (int i = 1; i < levels && dst[i].w >= thumb->w && dst[i].h >= thumb->h; i++)
+            src = &dst[i];
+
+        src_ptr = (const uint8_t*)src->ptr;
+        src_stride = src->stride;
+        dst_ptr = (uint8_t*)thumb->ptr;
+        dst_stride = thumb->stride;
+
+        swsCtx.Alloc (src->w, src->h, src->fmt, thumb->w, thumb->h, thumb->fmt, sws::Context::QUALITY_MAX);
+        swsCtx.setFilter (sws::Context::FILTER_LANCZOS);
+        swsCtx.setCancelToken (&cancel);
+        if (swsCtx.scaleMT (pool, &src_ptr, &src_stride, 0, src->h, &dst_ptr, &dst_stride) < 0)
+        {
+            cancel.Check();
+            throw runtime_error ("thumbnail scaling failed");
+        }
+    }
+}
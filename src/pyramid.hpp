@@ -0,0 +1,69 @@
+/**
+ * @file
+ * Multi-resolution renditions of a decoded image
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+#ifndef _PYRAMID_HPP_
+#define _PYRAMID_HPP_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "bpg_common.hpp"
+
+
+namespace bpg {
+
+/**
+ * Image pyramid: full size, 1/2, 1/4 ... and an optional thumbnail
+ *
+ * The decoded planes are converted once into level 0. Lower levels are 2x2 box
+ * filtered from the level above, in row bands that are small enough to stay in
+ * cache across all levels. The thumbnail is Lanczos scaled from the smallest
+ * level which is still larger than it.
+ */
+class Pyramid
+{
+public:
+    enum {
+        MAX_LEVELS = 8,
+    };
+
+    Pyramid (ThreadPool &pool);
+
+    void Build (
+        Decoder &dec,
+        enum AVPixelFormat fmt,
+        int levels,
+        int thumb_size = 0,
+        int quality = -1
+    );
+
+    void Build (
+        Decoder &dec,
+        FrameDesc dst[],
+        int levels,
+        FrameDesc *thumb = NULL,
+        int quality = -1
+    );
+
+    int GetLevels() const { return (int)frames.size(); }
+    const Frame& GetLevel (int i) const { return frames[i]; }
+    const Frame& GetThumbnail() const { return thumb; }
+
+    static void GetLevelSize (int w, int h, int level, int &lw, int &lh);
+    static void GetThumbnailSize (int w, int h, int thumb_size, int &tw, int &th);
+
+private:
+    class boxTask;
+
+    ThreadPool &pool;
+    std::vector<Frame> frames;
+    Frame thumb;
+};
+
+} // namespace bpg
+
+#endif /* _PYRAMID_HPP_ */
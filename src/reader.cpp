@@ -16,9 +16,13 @@ extern "C" {
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include "bpg_common.hpp"
+#include "bpg_stream.hpp"
+#include "av_util.hpp"
 #include "looptask.hpp"
 #include "benchmark.hpp"
+#include "log.h"
 
 
 #define GETBYTE(val,n)      (((val) >> ((n) * 8)) & 0xFF)
@@ -68,16 +72,202 @@ bool ImageInfo::CheckHeader (const void *buf, size_t len)
 
 
 Decoder::Decoder():
-    ctx (bpg_decoder_open(), bpg_decoder_close)
+    ctx (nullptr, bpg_decoder_close),
+    bAlphaSplit (false),
+    bUsed (false),
+    frameIdx (0)
 {
+    Reset();
+}
+
+
+/**
+ * Drop decoded image to decode another one
+ *
+ * libbpg context can not decode twice, so it is replaced by a new one; buffers of
+ * this wrapper are kept for the next image.
+ */
+void Decoder::Reset()
+{
+    ctx = pBPGDecoderContext (bpg_decoder_open(), bpg_decoder_close);
     if (!ctx)
         throw runtime_error ("bpg_decoder_open() failed");
+
+    bAlphaSplit = false;
+    bUsed = false;
+    frameIdx = 0;
+}
+
+
+/**
+ * Take an idle decoder, or a new one
+ */
+unique_ptr<Decoder> DecoderPool::Get()
+{
+    {
+        winthread::lock_guard _l(mtx);
+
+        if (!idle.empty())
+        {
+            unique_ptr<Decoder> dec = move (idle.back());
+            idle.pop_back();
+            return dec;
+        }
+    }
+
+    return unique_ptr<Decoder> (new Decoder);
+}
+
+
+/**
+ * Return a decoder, whose decoded image is dropped
+ */
+void DecoderPool::Put (unique_ptr<Decoder> &&dec)
+{
+    if (!dec)
+        return;
+
+    try {
+        dec->Reset();
+        dec->SetCancelToken (CancelToken());
+    }
+    catch (const exception &e) {
+        Loge ("%s: %s\n", __FUNCTION__, e.what());
+        dec.reset();
+        return;
+    }
+
+    winthread::lock_guard _l(mtx);
+
+    if (idle.size() < maxIdle)
+        idle.push_back (move (dec));
+    else
+        dec.reset();
+}
+
+
+/**
+ * Check CPU for the instruction set libbpg is compiled with (BPG_SIMD)
+ */
+bool bpg::IsCpuSupported()
+{
+#if BPG_SIMD_LEVEL > 0
+    __builtin_cpu_init();
+#endif
+
+#if BPG_SIMD_LEVEL >= 3
+    return __builtin_cpu_supports ("avx2");
+#elif BPG_SIMD_LEVEL == 2
+    return __builtin_cpu_supports ("ssse3");
+#elif BPG_SIMD_LEVEL == 1
+    return __builtin_cpu_supports ("sse2");
+#else
+    return true;
+#endif
+}
+
+
+/**
+ * Get a decoder from #gDecoderPool if any
+ */
+unique_ptr<Decoder> bpg::AcquireDecoder()
+{
+    if (gDecoderPool)
+        return gDecoderPool->Get();
+
+    return unique_ptr<Decoder> (new Decoder);
+}
+
+
+/**
+ * Return a decoder to #gDecoderPool if any, or destroy it
+ */
+void bpg::ReleaseDecoder (unique_ptr<Decoder> &&dec)
+{
+    if (gDecoderPool)
+        gDecoderPool->Put (move (dec));
+    else
+        dec.reset();
+}
+
+
+/**
+ * Decode colour and alpha streams in parallel
+ */
+void Decoder::decodeSplit (const void *buf, size_t len)
+{
+    vector<uint8_t> &color = streams[0];
+    vector<uint8_t> &alpha = streams[1];
+    string s_alpha_err;
+    int ret;
+
+    BpgStream::SplitAlpha (buf, len, color, alpha);
+    if (!alphaDec)
+        alphaDec = unique_ptr<Decoder> (new Decoder);
+    alphaDec->SetCancelToken (cancel);
+
+    PoolTask alphaTask (*gThreadPool, [&]() {
+        try {
+            alphaDec->DecodeBuffer (&alpha[0], alpha.size(), OPT_SERIAL);
+        }
+        catch (const exception &e) {
+            s_alpha_err = e.what();
+        }
+    });
+
+    ret = bpg_decoder_decode (ctx.get(), &color[0], color.size());
+    alphaTask.Join();
+
+    cancel.Check();
+
+    if (ret < 0 || !s_alpha_err.empty())
+        throw runtime_error ("split decoding failed");
+
+    FAIL_THROW (bpg_decoder_get_info (ctx.get(), &info));
+    info.has_alpha = 1;
+    bAlphaSplit = true;
 }
 
 
+/**
+ * Each HEVC picture is decoded by libbpg on the calling thread; only colour
+ * and alpha streams run in parallel (see decodeSplit()).
+ * @throw Cancelled if cancelled
+ */
 void Decoder::DecodeBuffer (const void *buf, size_t len, uint8_t opts)
 {
     Benchmark bm ("BPG decode");
+
+    cancel.Check();
+
+    if (bUsed)
+        Reset();
+    bUsed = true;
+
+    if (!(opts & (OPT_HEADER_ONLY | OPT_SERIAL)))
+    {
+        ImageInfo hdr;
+
+        hdr.LoadFromBuffer (buf, len);
+        if (hdr.has_alpha && !hdr.has_animation)
+        {
+            try {
+                decodeSplit (buf, len);
+                frameIdx = 0;
+                return;
+            }
+            catch (const Cancelled &e) {
+                throw;
+            }
+            catch (const exception &e) {
+                /* Fall back to libbpg, which needs a fresh context */
+                Logi ("%s: %s", __FUNCTION__, e.what());
+                Reset();
+                bUsed = true;
+            }
+        }
+    }
+
     BPGDecoderContext *_ctx = ctx.get();
 
     if (opts & OPT_HEADER_ONLY)
@@ -87,9 +277,51 @@ void Decoder::DecodeBuffer (const void *buf, size_t len, uint8_t opts)
     else
     {
         FAIL_THROW (bpg_decoder_decode (_ctx, (uint8_t*)buf, len));
+        cancel.Check();
     }
 
     FAIL_THROW (bpg_decoder_get_info (_ctx, &info));
+    frameIdx = 0;
+
+    /* Load the first frame of animation, so the frame duration is available */
+    if (info.has_animation && !(opts & OPT_HEADER_ONLY))
+        FAIL_THROW (bpg_decoder_start (_ctx, BPG_OUTPUT_FORMAT_RGB24) < 0);
+}
+
+
+/**
+ * Decode next frame of an animation
+ * @return false if no more frame
+ */
+bool Decoder::NextFrame()
+{
+    if (!info.has_animation)
+        return false;
+
+    if (bpg_decoder_start (ctx.get(), BPG_OUTPUT_FORMAT_RGB24) < 0)
+        return false;
+
+    frameIdx++;
+    return true;
+}
+
+
+/**
+ * Get display duration of current frame
+ * @return Duration in ms, 0 if not an animation
+ */
+uint32_t Decoder::GetFrameDuration() const
+{
+    int num, den;
+
+    if (!info.has_animation)
+        return 0;
+
+    bpg_decoder_get_frame_duration (ctx.get(), &num, &den);
+    if (den <= 0)
+        return 0;
+
+    return (uint64_t)num * 1000 / den;
 }
 
 
@@ -105,7 +337,9 @@ void Decoder::DecodeFile (const char s_file[], uint8_t opts)
     size_t fsize = ftell (_fp);
     fseek (_fp, 0, SEEK_SET);
 
-    vector<uint8_t> buf (fsize);
+    /* Kept for the next file */
+    vector<uint8_t> &buf = fileBuf;
+    buf.resize (fsize);
 
     if (fsize != fread (&buf[0], 1, fsize, _fp))
         throw runtime_error ("Failed to read file");
@@ -115,18 +349,10 @@ void Decoder::DecodeFile (const char s_file[], uint8_t opts)
 
 
 /**
- * Convert decoded frame to specified format
+ * Set up conversion of a w x h region of decoded frame into dw x dh
  */
-int Decoder::Convert (
-    enum AVPixelFormat dst_fmt,
-    void *dst,
-    int dst_stride,
-    int quality         ///< Conversion quality (0: lowest, 9: highest)
-)
+int Decoder::setupContext (sws::Context &swsCtx, int w, int h, int dw, int dh, enum AVPixelFormat dst_fmt, int quality)
 {
-    Benchmark bm ("BPG convert");
-    sws::Context swsCtx;
-
     {
         enum AVPixelFormat src_fmt;
 
@@ -134,7 +360,8 @@ int Decoder::Convert (
         if (src_fmt < 0)
             return -1;
 
-        swsCtx.Alloc (info.width, info.height, src_fmt, dst_fmt, quality);
+        swsCtx.Alloc (w, h, src_fmt, dw, dh, dst_fmt, quality);
+        swsCtx.setCancelToken (&cancel);
     }
 
     {
@@ -185,15 +412,206 @@ int Decoder::Convert (
         );
     }
 
+    return 0;
+}
+
+
+/**
+ * Get decoded planes, offset to (x, y)
+ * @note (x, y) must be aligned to chroma samples
+ */
+void Decoder::getPlanes (const uint8_t *src[4], int src_stride[4], int x, int y)
+{
+    const avutil::PixFmtDesc *desc = avutil::GetPixFmtDesc (info.GetAVPixFmt());
+    int bytes = desc->step;
+
+    for (int i = 0; i < 4; i++)
+        src[i] = bpg_decoder_get_data (ctx.get(), src_stride+i, i);
+
+    /* Alpha decoded separately */
+    if (bAlphaSplit)
+        src[3] = bpg_decoder_get_data (alphaDec->ctx.get(), src_stride+3, 0);
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (!src[i])
+            continue;
+
+        /* Chroma planes of YUV */
+        if (desc->isChroma (i))
+            src[i] += (ptrdiff_t)src_stride[i] * (y >> desc->log2_chroma_h) + bytes * (x >> desc->log2_chroma_w);
+        else
+            src[i] += (ptrdiff_t)src_stride[i] * y + bytes * x;
+    }
+}
+
+
+/**
+ * Describe decoded image for conv::Convert()
+ */
+void Decoder::getSource (conv::Source &src)
+{
+    getPlanes (src.data, src.stride, 0, 0);
+    src.fmt = info.GetAVPixFmt();
+    src.w = info.width;
+    src.h = info.height;
+    src.color_space = info.color_space;
+    src.limited_range = info.limited_range;
+}
+
+
+/**
+ * Convert decoded frame to specified format
+ * @return -1 if failed or cancelled
+ */
+int Decoder::Convert (
+    enum AVPixelFormat dst_fmt,
+    void *dst,
+    int dst_stride,
+    int quality         ///< Conversion quality (0: lowest, 9: highest)
+)
+{
+    return ConvertRect (dst_fmt, dst, dst_stride, 0, 0, info.width, info.height, quality);
+}
+
+
+/**
+ * Convert decoded frame and scale it to dst_w x dst_h
+ * @param filter    sws::Context::FILTER_*, or chosen by quality
+ */
+int Decoder::Convert (
+    enum AVPixelFormat dst_fmt,
+    void *dst,
+    int dst_stride,
+    int dst_w, int dst_h,
+    int quality,
+    int filter
+)
+{
+    Benchmark bm ("BPG convert & scale");
+    sws::Context swsCtx;
+    const uint8_t *src[4];
+    int src_stride[4];
+
+    if (dst_w <= 0 || dst_h <= 0)
+        return -1;
+
+    if (setupContext (swsCtx, info.width, info.height, dst_w, dst_h, dst_fmt, quality) < 0)
+        return -1;
+
+    swsCtx.setFilter (filter);
+    getPlanes (src, src_stride, 0, 0);
+    return swsCtx.scaleMT (*gThreadPool, src, src_stride, 0, info.height, (uint8_t**)&dst, &dst_stride);
+}
+
+
+/**
+ * Convert a rectangle of decoded frame, e.g. visible region or a tile
+ *
+ * The region is extended by the filter radius and aligned to chroma samples and to
+ * the 8x8 swscale dither pattern, so output matches converting the whole frame.
+ * Odd widths / heights of subsampled chroma convert whole rows / columns.
+ * @param dst   Buffer of the rectangle, pixel (x, y) at its top-left
+ */
+int Decoder::ConvertRect (
+    enum AVPixelFormat dst_fmt,
+    void *dst,
+    int dst_stride,
+    int x, int y, int w, int h,
+    int quality
+)
+{
+    Benchmark bm ("BPG convert");
+    sws::Context swsCtx;
+    const avutil::PixFmtDesc *desc;
+    int x0, y0, x1, y1;
+
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+        x + w > (int)info.width || y + h > (int)info.height)
+        return -1;
+
+    desc = avutil::GetPixFmtDesc (info.GetAVPixFmt());
+    if (!desc)
+        return -1;
+
+    /* Specialized kernels read chroma outside the rectangle directly */
+    {
+        conv::Source s;
+
+        getSource (s);
+        if (conv::IsSupported (s, dst_fmt, quality))
+            return conv::Convert (*gThreadPool, s, dst_fmt, (uint8_t*)dst, dst_stride, x, y, w, h, &cancel);
+    }
+
+    if (setupContext (swsCtx, w, h, w, h, dst_fmt, quality) < 0)
+        return -1;
+
+    {
+        int haloX = swsCtx.getHalo (true);
+        int haloY = swsCtx.getHalo();
+        int cw = (1 << desc->log2_chroma_w) - 1;
+        int ch = (1 << desc->log2_chroma_h) - 1;
+
+        /* Start at multiples of 8, which are chroma aligned too */
+        x0 = max (x - haloX, 0) & ~7;
+        y0 = max (y - haloY, 0) & ~7;
+        x1 = min ((x + w + haloX + cw) & ~cw, (int)info.width);
+        y1 = min ((y + h + haloY + ch) & ~ch, (int)info.height);
+
+        /* Chroma step of the whole frame is rounded if not divisible by chroma
+         * samples, no region has the same; convert whole rows / columns */
+        if (info.width & cw)
+        {
+            x0 = 0;
+            x1 = info.width;
+        }
+
+        if (info.height & ch)
+        {
+            y0 = 0;
+            y1 = info.height;
+        }
+    }
+
+    if (setupContext (swsCtx, x1 - x0, y1 - y0, x1 - x0, y1 - y0, dst_fmt, quality) < 0)
+        return -1;
+
     {
         const uint8_t *src[4];
         int src_stride[4];
 
-        /* Framebuffer */
-        for (int i = 0; i < 4; i++)
-            src[i] = bpg_decoder_get_data (ctx.get(), src_stride+i, i);
+        getPlanes (src, src_stride, x0, y0);
+
+        /* Nothing to crop */
+        if (x0 == x && y0 == y && x1 == x + w && y1 == y + h)
+            return swsCtx.scaleMT (*gThreadPool, src, src_stride, 0, y1 - y0, (uint8_t**)&dst, &dst_stride);
 
-        return swsCtx.scaleMT (*gThreadPool, src, src_stride, 0, info.height, (uint8_t**)&dst, &dst_stride);
+        /* Convert extended region, then crop */
+        Frame tmp;
+        uint8_t *tmp_ptr;
+        int tmp_stride;
+        int bpp;
+        int ret;
+
+        tmp.AllocByFormat (x1 - x0, y1 - y0, dst_fmt);
+        tmp_ptr = (uint8_t*)tmp.ptr;
+        tmp_stride = tmp.stride;
+        bpp = Frame::GetBytesPerPixel (dst_fmt);
+
+        ret = swsCtx.scaleMT (*gThreadPool, src, src_stride, 0, y1 - y0, &tmp_ptr, &tmp_stride);
+        if (ret < 0)
+            return ret;
+
+        for (int i = 0; i < h; i++)
+        {
+            memcpy (
+                (uint8_t*)dst + (ptrdiff_t)dst_stride * i,
+                tmp_ptr + (size_t)tmp_stride * (y - y0 + i) + bpp * (x - x0),
+                bpp * w
+            );
+        }
+
+        return ret;
     }
 }
 
@@ -226,6 +644,111 @@ int Decoder::ConvertToFrame (Frame &frame, int quality)
 }
 
 
+BandReader::BandReader (Decoder &dec, int quality):
+    dec(dec),
+    quality(quality),
+    y0(0), y1(0)
+{
+    const ImageInfo &info = dec.GetInfo();
+
+    switch (info.GetBpp())
+    {
+    case 8:  fmt = AV_PIX_FMT_GRAY8; break;
+    case 24: fmt = AV_PIX_FMT_RGB24; break;
+    case 32: fmt = AV_PIX_FMT_RGBA;  break;
+    default: throw runtime_error ("invalid format");
+    }
+
+    bandRows = BAND_BYTES / (info.width * Frame::GetBytesPerPixel (fmt));
+    bandRows = min (max (bandRows, (int)MIN_BAND_ROWS), (int)info.height);
+}
+
+
+/**
+ * Convert the band of row y, if not converted yet
+ * @throw runtime_error if conversion failed
+ */
+void BandReader::load (int y)
+{
+    const ImageInfo &info = dec.GetInfo();
+
+    if (y < 0 || y >= (int)info.height)
+        throw runtime_error ("invalid line");
+
+    if (y >= y0 && y < y1)
+        return;
+
+    if (!band)
+        band.AllocByFormat (info.width, bandRows, fmt);
+
+    y0 = y - y % bandRows;
+    y1 = min (y0 + bandRows, (int)info.height);
+
+    if (dec.ConvertRect (fmt, band.ptr, band.stride, 0, y0, info.width, y1 - y0, quality) < 0)
+    {
+        y0 = y1 = 0;
+        dec.GetCancelToken().Check();
+        throw runtime_error ("conversion failed");
+    }
+}
+
+
+void BandReader::GetLine (int y, void *dst)
+{
+    load (y);
+    band.GetLine (y - y0, dst);
+}
+
+
+/**
+ * Convert all rows, band by band, into func
+ */
+void BandReader::Export (const BandFunc &func)
+{
+    const ImageInfo &info = dec.GetInfo();
+
+    for (int y = 0; y < (int)info.height; y += bandRows)
+    {
+        FrameDesc d;
+
+        load (y);
+        d = band;
+        d.h = y1 - y0;
+        func (y0, d);
+    }
+}
+
+
+/**
+ * Write all rows as PGM (gray), PPM (RGB) or PAM (RGBA)
+ */
+void BandReader::Export (FILE *fp)
+{
+    const ImageInfo &info = dec.GetInfo();
+
+    switch (fmt)
+    {
+    case AV_PIX_FMT_GRAY8:
+        fprintf (fp, "P5\n%u %u\n255\n", info.width, info.height);
+        break;
+    case AV_PIX_FMT_RGB24:
+        fprintf (fp, "P6\n%u %u\n255\n", info.width, info.height);
+        break;
+    default:
+        fprintf (fp, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", info.width, info.height);
+        break;
+    }
+
+    Export ([fp](int y, const FrameDesc &d) {
+        for (uint32_t r = 0; r < d.h; r++)
+        {
+            if (fwrite ((const uint8_t*)d.ptr + (size_t)d.stride * r, d.GetLineSize(), 1, fp) != 1)
+                throw runtime_error ("write failed");
+        }
+    });
+}
+
+
 void ImageInfo::GetFormatDetail (char buf[], size_t sz) const
 {
     static const char *s_fmt[] = {
@@ -260,96 +783,5 @@ void ImageInfo::GetFormatDetail (string &s) const
  */
 enum AVPixelFormat ImageInfo::GetAVPixFmt() const
 {
-    switch (format)
-    {
-    case BPG_FORMAT_GRAY:
-        return AV_PIX_FMT_GRAY16BE;
-
-    case BPG_FORMAT_420:
-    case BPG_FORMAT_420_VIDEO:
-        if (has_alpha)
-        {
-            switch (bit_depth)
-            {
-            case 8:  return AV_PIX_FMT_YUVA420P16BE;
-            case 9:  return AV_PIX_FMT_YUVA420P9LE;
-            case 10: return AV_PIX_FMT_YUVA420P10LE;
-            default: break;
-            }
-        }
-        else
-        {
-            switch (bit_depth)
-            {
-            case 8:  return AV_PIX_FMT_YUV420P16BE;
-            case 9:  return AV_PIX_FMT_YUV420P9LE;
-            case 10: return AV_PIX_FMT_YUV420P10LE;
-            case 12: return AV_PIX_FMT_YUV420P12LE;
-            case 14: return AV_PIX_FMT_YUV420P14LE;
-            default: break;
-            }
-        }
-        break;
-
-    case BPG_FORMAT_422:
-    case BPG_FORMAT_422_VIDEO:
-        if (has_alpha)
-        {
-            switch (bit_depth)
-            {
-            case 8:  return AV_PIX_FMT_YUVA422P16BE;
-            case 9:  return AV_PIX_FMT_YUVA422P9LE;
-            case 10: return AV_PIX_FMT_YUVA422P10LE;
-            default: break;
-            }
-        }
-        else
-        {
-            switch (bit_depth)
-            {
-            case 8:  return AV_PIX_FMT_YUV422P16BE;
-            case 9:  return AV_PIX_FMT_YUV422P9LE;
-            case 10: return AV_PIX_FMT_YUV422P10LE;
-            case 12: return AV_PIX_FMT_YUV422P12LE;
-            case 14: return AV_PIX_FMT_YUV422P14LE;
-            default: break;
-            }
-        }
-        break;
-    case BPG_FORMAT_444:
-        if (color_space == BPG_CS_RGB)
-        {
-            if (has_alpha)
-                return AV_PIX_FMT_GBRAP16BE;
-            else
-                return AV_PIX_FMT_GBRP16BE;
-        }
-        else if (has_alpha)
-        {
-            switch (bit_depth)
-            {
-            case 8:  return AV_PIX_FMT_YUVA444P16BE;
-            case 9:  return AV_PIX_FMT_YUVA444P9LE;
-            case 10: return AV_PIX_FMT_YUVA444P10LE;
-            default: break;
-            }
-        }
-        else
-        {
-            switch (bit_depth)
-            {
-            case 8:  return AV_PIX_FMT_YUV444P16BE;
-            case 9:  return AV_PIX_FMT_YUV444P9LE;
-            case 10: return AV_PIX_FMT_YUV444P10LE;
-            case 12: return AV_PIX_FMT_YUV444P12LE;
-            case 14: return AV_PIX_FMT_YUV444P14LE;
-            default: break;
-            }
-        }
-        break;
-
-    default:
-        break;
-    }
-    return AV_PIX_FMT_NONE;
+    return avutil::GetBpgPixFmt (format, has_alpha, color_space == BPG_CS_RGB, bit_depth);
 }
@@ -15,12 +15,18 @@ extern "C" {
 }
 
 #include "log.h"
-#include "av_util.hpp"
 
 #define BPG_COMMON_SET
 #include "bpg_common.hpp"
+#include "prefetcher.hpp"
 
 
+/** Optional, with a "prefetch:" line to enable read-ahead of folder */
+#define CONFIG_FILE     "bpg_spi.ini"
+
+/** Interval of calling host's progress callback, which may abort loading */
+#define PROGRESS_POLL_MS    10
+
 #define NELEM(ary)      ((size_t)(sizeof(ary)/sizeof(ary[0])))
 #define ALIGN(x,n)      ((((x) + ((n)-1)) / (n)) * (n))
 
@@ -28,6 +34,9 @@ using namespace std;
 using namespace bpg;
 
 
+static Prefetcher *gPrefetcher;
+
+
 EXTC int __stdcall GetPluginInfo(int infono, LPSTR buf, int buflen)
 {
     static const char *pluginfo[] = {
@@ -102,27 +111,62 @@ EXTC int __stdcall GetPictureInfo
 }
 
 
+/**
+ * Run a loading step on thread pool, calling host's progress callback meanwhile
+ * @throw Cancelled if host aborts
+ */
+static void run_step (const function<void()> &fn, CancelToken &cancel,
+        SPI_PROGRESS lpPrgressCallback, int num, int denom, long lData)
+{
+    if (!lpPrgressCallback)
+    {
+        fn();
+        return;
+    }
+
+    RunCancellable (*gThreadPool, fn, cancel, [&]() {
+        return 0 != lpPrgressCallback (num, denom, lData);
+    }, PROGRESS_POLL_MS);
+}
+
+
 static int read_image (LPSTR buf, long len, unsigned int flag,
         HANDLE *pHBInfo, HANDLE *pHBm,
         SPI_PROGRESS lpPrgressCallback, long lData, bool hq_output)
 {
     int ret = SPI_OTHER_ERROR;
-    Decoder dec;
+    unique_ptr<Decoder> pdec;
+    CancelToken cancel;
 
-    if (lpPrgressCallback)
-        lpPrgressCallback (0, 1, lData);
+    if (lpPrgressCallback && lpPrgressCallback (0, 1, lData))
+        return SPI_ABORT;
 
     try {
         {
             if ((flag & 7) == 0) {
             /* buf is the filename */
-                dec.DecodeFile (buf);
+                pdec = gPrefetcher->Take (buf);
+                if (!pdec)
+                {
+                    pdec = AcquireDecoder();
+                    pdec->SetCancelToken (cancel);
+                    run_step ([&]() { pdec->DecodeFile (buf); }, cancel, lpPrgressCallback, 0, 1, lData);
+                }
+
+                /* Neighbours are decoded while this one is being shown */
+                gPrefetcher->Schedule (buf);
             } else {
             /* buf is the pointer to buffer */
-                dec.DecodeBuffer (buf, len);
+                pdec = AcquireDecoder();
+                pdec->SetCancelToken (cancel);
+                run_step ([&]() { pdec->DecodeBuffer (buf, len); }, cancel, lpPrgressCallback, 0, 1, lData);
             }
         }
 
+        pdec->SetCancelToken (cancel);
+
+        Decoder &dec = *pdec;
+
         const ImageInfo &info = dec.GetInfo();
         int bpp = info.GetBpp();
 
@@ -192,7 +236,20 @@ static int read_image (LPSTR buf, long len, unsigned int flag,
             dst = (uint8_t*)buf + (linesz * (info.height-1));
             dst_stride = -linesz;
 
-            dec.Convert (dst_fmt, dst, dst_stride);
+            try {
+                run_step ([&]() {
+                    dec.Convert (dst_fmt, dst, dst_stride);
+                }, cancel, lpPrgressCallback, 1, 2, lData);
+            }
+            catch (const Cancelled &e) {
+                LocalUnlock (*pHBm);
+                LocalUnlock (*pHBInfo);
+                LocalFree (*pHBm);
+                LocalFree (*pHBInfo);
+                *pHBm = NULL;
+                *pHBInfo = NULL;
+                throw;
+            }
         }
         while (0);
 
@@ -204,6 +261,7 @@ static int read_image (LPSTR buf, long len, unsigned int flag,
         LocalUnlock (*pHBInfo);
 
         ret = SPI_ALL_RIGHT;
+        ReleaseDecoder (move (pdec));
         return ret;
 
 fail_lock_img:
@@ -217,10 +275,15 @@ fail_alloc_img:
 fail_alloc_info:
         ;
     }
+    catch (const Cancelled &e) {
+        Logi ("%s: aborted by host\n", __FUNCTION__);
+        ret = SPI_ABORT;
+    }
     catch (const exception &e) {
         Loge (e.what());
     }
 
+    ReleaseDecoder (move (pdec));
     return ret;}
 
 
@@ -248,13 +311,39 @@ EXTC BOOL APIENTRY DllMain(HANDLE hModule, DWORD ul_reason, LPVOID lpReserved)
     {
     case DLL_PROCESS_ATTACH:
         Logi ("Compiled at %s %s\n", __TIME__, __DATE__);
+        if (!bpg::IsCpuSupported())
+        {
+            Loge ("CPU does not support instruction set of libbpg\n");
+            return FALSE;
+        }
+
         bpg::gThreadPool = new ThreadPool;
-        avutil::init();
+        bpg::gDecoderPool = new DecoderPool;
+
+        /* Read-ahead of folder */
+        {
+            IniFile f_ini;
+            Prefetcher::Config cfg;
+            string s_opts;
+
+            f_ini.Open (CONFIG_FILE);
+            f_ini.GetLineByPrefix (s_opts, "prefetch:");
+            cfg.Parse (s_opts.c_str());
+
+            gPrefetcher = new Prefetcher (*bpg::gThreadPool);
+            gPrefetcher->SetConfig (cfg);
+        }
         break;
 
     case DLL_PROCESS_DETACH:
-        avutil::deinit();
+        /* Process exit: other threads are terminated, tasks they run never end */
+        if (lpReserved)
+            break;
+
+        delete gPrefetcher;
+        bpg::gThreadPool->Join();
         delete bpg::gThreadPool;
+        delete bpg::gDecoderPool;
         break;
 
     default:
@@ -10,7 +10,13 @@ extern "C" {
 #include "libswscale/swscale.h"
 }
 
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <new>
+#include <atomic>
 #include <exception>
+#include <algorithm>
 #include "sws_context.hpp"
 #include "av_util.hpp"
 #include "threadpool.hpp"
@@ -22,13 +28,25 @@ using namespace sws;
 using namespace avutil;
 
 
+/** Source rows per sws_scale() call of subtasks, between cancellation checks */
+#define SLICE_ROWS  64
+
+/** Source rows of a scaleMT() subtask at least, each one initializes a SwsContext */
+#define MIN_ROWS_PER_TASK   32
+
+/** Max. idle SwsContexts kept */
+#define MAX_IDLE_CONTEXTS   16
+
+
 Context::Context():
-    w(0), h(0), algo(0),
-    src ({NULL, NULL, AV_PIX_FMT_NONE, NULL, 1}),
-    dst ({NULL, NULL, AV_PIX_FMT_NONE, NULL, 1}),
+    w(0), h(0), dw(0), dh(0), algo(0),
+    src ({NULL, NULL, AV_PIX_FMT_NONE, NULL, NULL, 1}),
+    dst ({NULL, NULL, AV_PIX_FMT_NONE, NULL, NULL, 1}),
     brightness (0),
     contrast   (1 << 16),
-    saturation (1 << 16)
+    saturation (1 << 16),
+    cancel (NULL),
+    sliceCtx (nullptr, sws_freeContext)
 {
     src.coeff =
     dst.coeff = sws_getCoefficients (SWS_CS_DEFAULT);
@@ -58,15 +76,72 @@ uint32_t Context::quality2algo (int quality)
 
 void Context::Alloc (int w, int h, enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt, int quality)
 {
+    Alloc (w, h, src_fmt, w, h, dst_fmt, quality);
+}
+
+
+/**
+ * Convert and scale w x h source into dw x dh destination
+ */
+void Context::Alloc (
+    int w, int h, enum AVPixelFormat src_fmt,
+    int dw, int dh, enum AVPixelFormat dst_fmt,
+    int quality
+)
+{
+    uint32_t algo = quality2algo (quality);
+    const PixFmtDesc *src_desc = GetPixFmtDesc (src_fmt);
+    const PixFmtDesc *dst_desc = GetPixFmtDesc (dst_fmt);
+
+    if (!src_desc || !dst_desc)
+        throw runtime_error ("unsupported pixel format");
+
+    /* Rows of up to 8 bytes a pixel are addressed by int strides */
+    if (w <= 0 || h <= 0 || dw <= 0 || dh <= 0 || (int64_t)max (w, dw) * 8 > INT_MAX)
+        throw runtime_error ("invalid size");
+
+    /* Same settings, keep SwsContexts */
+    if ((int)this->w == w && (int)this->h == h && (int)this->dw == dw && (int)this->dh == dh &&
+        src.fmt == src_fmt && dst.fmt == dst_fmt && this->algo == algo)
+        return;
+
+    flushContexts();
+
     this->w = w;
     this->h = h;
+    this->dw = dw;
+    this->dh = dh;
     src.fmt = src_fmt;
-    src.desc = avutil::av_pix_fmt_desc_get (src_fmt);
-    src.planes = avutil::av_pix_fmt_count_planes (src_fmt);
+    src.desc = src_desc;
     dst.fmt = dst_fmt;
-    dst.desc = avutil::av_pix_fmt_desc_get (dst_fmt);
-    dst.planes = avutil::av_pix_fmt_count_planes (dst_fmt);
-    algo = quality2algo (quality);
+    dst.desc = dst_desc;
+    this->algo = algo;
+}
+
+
+void Context::setFilter (int filter)
+{
+    static const uint32_t FILTER_MASK =
+        SWS_FAST_BILINEAR | SWS_BILINEAR | SWS_BICUBIC | SWS_X | SWS_POINT |
+        SWS_AREA | SWS_BICUBLIN | SWS_GAUSS | SWS_SINC | SWS_LANCZOS | SWS_SPLINE;
+    uint32_t flag;
+
+    switch (filter)
+    {
+        case FILTER_POINT:    flag = SWS_POINT;    break;
+        case FILTER_BILINEAR: flag = SWS_BILINEAR; break;
+        case FILTER_BICUBIC:  flag = SWS_BICUBIC;  break;
+        case FILTER_AREA:     flag = SWS_AREA;     break;
+        case FILTER_LANCZOS:  flag = SWS_LANCZOS;  break;
+        default: return;
+    }
+
+    flag |= algo & ~FILTER_MASK;
+    if (flag != algo)
+    {
+        flushContexts();
+        algo = flag;
+    }
 }
 
 
@@ -80,6 +155,14 @@ void Context::setColorSpace (
     int brightness, int contrast, int saturation
 )
 {
+    const int *src_coeff = sws_getCoefficients (src_cs);
+    const int *dst_coeff = sws_getCoefficients (dst_cs);
+
+    if (src.coeff != src_coeff || src.full_rng != src_full_rng ||
+        dst.coeff != dst_coeff || dst.full_rng != dst_full_rng ||
+        this->brightness != brightness || this->contrast != contrast || this->saturation != saturation)
+        flushContexts();
+
     src.coeff    = sws_getCoefficients (src_cs);
     src.full_rng = src_full_rng;
     dst.coeff    = sws_getCoefficients (dst_cs);
@@ -90,6 +173,64 @@ void Context::setColorSpace (
 }
 
 
+/**
+ * Get an idle SwsContext of full width with specified heights, or create one
+ * Return it by putContext() after use.
+ */
+pSwsContext Context::getContext (int src_h, int dst_h) const
+{
+    {
+        winthread::lock_guard _l(idleMtx);
+
+        for (list<idleContext>::iterator it = idle.begin(); it != idle.end(); ++it)
+        {
+            if (it->src_h == src_h && it->dst_h == dst_h)
+            {
+                pSwsContext p = move (it->p);
+                idle.erase (it);
+                return p;
+            }
+        }
+    }
+
+    pSwsContext p (
+        sws_getContext (w, src_h, src.fmt, dw, dst_h, dst.fmt, algo, NULL, NULL, NULL),
+        sws_freeContext
+    );
+
+    if (p)
+    {
+        sws_setColorspaceDetails (
+            p.get(),
+            src.coeff, src.full_rng,
+            dst.coeff, dst.full_rng,
+            brightness, contrast, saturation
+        );
+    }
+
+    return p;
+}
+
+
+void Context::putContext (int src_h, int dst_h, pSwsContext &&p) const
+{
+    winthread::lock_guard _l(idleMtx);
+
+    if (!p || idle.size() >= MAX_IDLE_CONTEXTS)
+        return;
+
+    idle.push_back (idleContext {src_h, dst_h, move (p)});
+}
+
+
+void Context::flushContexts()
+{
+    winthread::lock_guard _l(idleMtx);
+    idle.clear();
+    sliceCtx.reset();
+}
+
+
 int Context::scale (
     const uint8_t *srcSlice[],
     const int srcStride[],
@@ -102,52 +243,57 @@ int Context::scale (
     dst.bufs = (void**)dstSlice;
     dst.stride = dstStride;
 
-    pSwsContext p (
-        sws_getContext (w, h, src.fmt, w, h, dst.fmt, algo, NULL, NULL, NULL),
-        sws_freeContext
-    );
+    pSwsContext p = getContext (h, dh);
 
     if (!p)
         return -1;
 
-    sws_setColorspaceDetails (
-        p.get(),
-        src.coeff, src.full_rng,
-        dst.coeff, dst.full_rng,
-        brightness, contrast, saturation
-    );
-
-    return sws_scale (p.get(), (const uint8_t**)src.bufs, src.stride, srcSliceY, srcSliceH, (uint8_t**)dst.bufs, dst.stride);
+    int ret = sws_scale (p.get(), (const uint8_t**)src.bufs, src.stride, srcSliceY, srcSliceH, (uint8_t**)dst.bufs, dst.stride);
+    putContext (h, dh, move (p));
+    return ret;
 }
 
 
-
 /**
- * Subtask for Context::scaleMT()
+ * Scale an image fed slice by slice, from top to bottom
+ *
+ * The SwsContext is kept from the first slice to the last one, so swscale
+ * carries its filter history across slices and the output is identical to
+ * scale() of the whole image. Source addresses are of the slice, destination
+ * addresses are of the whole image.
  */
-class Context::convertTask: public LoopTask
+int Context::scaleSlice (
+    const uint8_t *srcSlice[],
+    const int srcStride[],
+    int srcSliceY, int srcSliceH,
+    uint8_t *const dstSlice[], const int dstStride[]
+)
 {
-private:
-    Context &ctx;
+    src.bufs = (void**)srcSlice;
+    src.stride = srcStride;
+    dst.bufs = (void**)dstSlice;
+    dst.stride = dstStride;
 
-public:
-    convertTask (Context &ctx): ctx(ctx) {}
-    virtual void loop (int begin, int end, int step) override;
-};
+    if (srcSliceY == 0)
+    {
+        if (sliceCtx)
+            putContext (h, dh, move (sliceCtx));
+        sliceCtx = getContext (h, dh);
+    }
 
+    if (!sliceCtx)
+        return -1;
 
-bool Context::attr::isPLANAR() const
-{
-    return !!(desc->flags & AV_PIX_FMT_FLAG_PLANAR);
-}
+    int ret = sws_scale (sliceCtx.get(), (const uint8_t**)src.bufs, src.stride, srcSliceY, srcSliceH, (uint8_t**)dst.bufs, dst.stride);
 
+    if (srcSliceY + srcSliceH >= (int)h)
+        putContext (h, dh, move (sliceCtx));
 
-bool Context::attr::isRGB() const
-{
-    return !!(desc->flags & AV_PIX_FMT_FLAG_RGB);
+    return ret;
 }
 
 
+
 /**
  * Perform Y offset on src/dst slice addresses
  */
@@ -156,68 +302,21 @@ void Context::calcAddr (uint8_t *buf[4], const attr &a, int y)
     int i;
 
     /* Load original address */
-    for (i = 0; i < a.planes; i++)
+    for (i = 0; i < a.desc->planes; i++)
         buf[i] = (uint8_t*)a.bufs[i];
 
     if (y) // Need offset
     {
-        if (a.isPLANAR() && !a.isRGB()) // Planar YUV
-        {
-            buf[0] += a.stride[0] * y;
-            buf[1] += a.stride[1] * (y >> a.desc->log2_chroma_h);
-            buf[2] += a.stride[2] * (y >> a.desc->log2_chroma_h);
-            if (a.planes > 3) // A
-                buf[3] += a.stride[3] * y;
-        }
-        else
-        {
-            for (i = 0; i < a.planes; i++)
-                buf[i] += a.stride[i] * y;
-        }
+        for (i = 0; i < a.desc->planes; i++)
+            buf[i] += (ptrdiff_t)a.stride[i] * (y >> a.desc->rowShift (i));
     }
 }
 
 
-void Context::convertTask::loop (int begin, int end, int step)
-{
-    const uint8_t *src[4];
-    uint8_t *dst[4];
-    int h;
-
-    Logi ("%s: (%d, %d, %d)", __PRETTY_FUNCTION__, begin, end, step);
-    calcAddr ((uint8_t**)src, ctx.src, begin);
-    calcAddr (dst, ctx.dst, begin);
-
-    if (ctx.src.planes == 0)
-        return;
-    for (int i = 0; i < ctx.src.planes; i++)
-        Logi ("src plane[%d] %p -> %p", i, ctx.src.bufs[i], src[i]);
-    for (int i = 0; i < ctx.dst.planes; i++)
-        Logi ("dst plane[%d] %p -> %p", i, ctx.dst.bufs[i], dst[i]);
-
-    h = end - begin;
-
-    pSwsContext p (
-        sws_getContext (ctx.w, h, ctx.src.fmt, ctx.w, h, ctx.dst.fmt, ctx.algo, NULL, NULL, NULL),
-        sws_freeContext
-    );
-
-    if (!p)
-        return;
-
-    sws_setColorspaceDetails (
-        p.get(),
-        ctx.src.coeff, ctx.src.full_rng,
-        ctx.dst.coeff, ctx.dst.full_rng,
-        ctx.brightness, ctx.contrast, ctx.saturation
-    );
-
-    sws_scale (p.get(), src, ctx.src.stride, 0, h, dst, ctx.dst.stride);
-}
-
-
 /**
  * sws_scale() Multi-Thread version
+ *
+ * Output is identical to scale(), see initBands().
  */
 int Context::scaleMT (
     ThreadPool &pool,
@@ -232,8 +331,225 @@ int Context::scaleMT (
     dst.bufs = (void**)dstSlice;
     dst.stride = dstStride;
 
+    return scaleBands (pool);
+}
+
+
+static int gcd (int a, int b)
+{
+    while (b)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+/**
+ * Vertical step of swscale in 1/65536 source rows
+ * @return 0 if it is rounded
+ */
+static int64_t exactInc (int src_h, int dst_h)
+{
+    int64_t n = (int64_t)src_h << 16;
+    return n % dst_h ? 0 : n / dst_h;
+}
+
+
+/**
+ * Split scaling into bands of whole units
+ *
+ * A unit is srcRows source rows scaled into dstRows destination rows, where
+ * srcRows : dstRows = h : dh exactly. Bands are extended by halo units to cover
+ * the filter taps of luma and chroma, and the extension is thrown away. The
+ * last unit may be partial, it holds the rows left and is scaled by a
+ * SwsContext of its own height.
+ *
+ * Filter positions of each band start at 0, so they match the whole image
+ * only if swscale steps of luma and chroma are exact, i.e. not rounded;
+ * otherwise the error accumulates from band to band. E.g. odd rows of 4:2:0
+ * scaled into RGB have a rounded chroma step, and are not split.
+ *
+ * Units are also aligned to chroma rows and to 8 destination rows, the
+ * period of swscale dithering, so banded output is identical to scale().
+ * @return false if image is too small to be split, or steps are not exact
+ */
+bool Context::initBands()
+{
+    int a = gcd (h, dh);
+    int cf = 1 << src.desc->rowShift (1);
+    int ss = src.desc->rowShift (1), ds = dst.desc->rowShift (1);
+    int halo;
+
+    band.srcRows = h / a;
+    band.dstRows = dh / a;
+
+    {
+        int ks = cf / gcd (band.srcRows, cf);
+        int kd = 8 / gcd (band.dstRows, 8);
+        int k = ks / gcd (ks, kd) * kd;
+
+        band.srcRows *= k;
+        band.dstRows *= k;
+    }
+
+    band.units = (h + band.srcRows - 1) / band.srcRows;
+
+    if (band.units < 2)
+        return false;
+
+    /* Same exact steps for the whole image, a unit and the last one */
+    {
+        int lastSrc = h - (band.units - 1) * band.srcRows;
+        int lastDst = dh - (band.units - 1) * band.dstRows;
+        int64_t inc = exactInc (h, dh);
+        int64_t chrInc = exactInc (-((-(int)h) >> ss), -((-(int)dh) >> ds));
+
+        if (!inc || inc != exactInc (band.srcRows, band.dstRows) ||
+            !chrInc || chrInc != exactInc (band.srcRows >> ss, band.dstRows >> ds))
+            return false;
+
+        if (inc != exactInc (lastSrc, lastDst) ||
+            chrInc != exactInc (-(-lastSrc >> ss), -(-lastDst >> ds)))
+            return false;
+    }
+
+    halo = getHalo();
+    band.haloUnits = (halo + band.srcRows - 1) / band.srcRows;
+
+    return true;
+}
+
+
+/**
+ * Source rows (or columns) beyond a region that its output depends on
+ *
+ * Filter radius in source rows, in chroma rows for chroma, so a region extended
+ * by the halo and aligned to chroma samples converts as the whole image does.
+ */
+int Context::getHalo (bool horizontal) const
+{
+    int shift = horizontal ?
+        (src.desc->isChroma (1) ? src.desc->log2_chroma_w : 0) :
+        src.desc->rowShift (1);
+    int ratio = horizontal ? (w + dw - 1) / dw : (h + dh - 1) / dh;
+
+    return (1 << shift) * (((algo & SWS_LANCZOS) ? 3 : 2) * ratio + 2);
+}
+
+
+/**
+ * Whether scaleMT() splits the image into bands, or falls back to scale()
+ */
+bool Context::isBanded()
+{
+    return initBands();
+}
+
+
+/**
+ * Subtask for Context::scaleBands()
+ */
+class Context::scaleTask: public LoopTask
+{
+private:
+    Context &ctx;
+    atomic<bool> &failed;   ///< Set if any band failed, shared by subtasks
+
+public:
+    scaleTask (Context &ctx, atomic<bool> &failed): ctx(ctx), failed(failed) {}
+    virtual void loop (int64_t begin, int64_t end, int64_t step) override;
+};
+
+
+void Context::scaleTask::loop (int64_t begin, int64_t end, int64_t step)
+{
+    const uint8_t *src[4];
+    uint8_t *tmp_ptr[4] = {NULL};
+    int tmp_stride[4] = {0};
+    int linesz[4];
+    size_t tmp_size = 0;
+    int b0, b1;
+    int src_h, dst_h;
+    int slice = (SLICE_ROWS + ctx.band.srcRows - 1) / ctx.band.srcRows * ctx.band.srcRows;
+
+    /* Extend by halo, the last unit may be partial */
+    b0 = (int)max<int64_t> (begin - ctx.band.haloUnits, 0);
+    b1 = (int)min<int64_t> (end + ctx.band.haloUnits, ctx.band.units);
+    src_h = min<int> (b1 * ctx.band.srcRows, ctx.h) - b0 * ctx.band.srcRows;
+    dst_h = min<int> (b1 * ctx.band.dstRows, ctx.dh) - b0 * ctx.band.dstRows;
+
+    pSwsContext p = ctx.getContext (src_h, dst_h);
+
+    if (!p)
+    {
+        failed = true;
+        return;
+    }
+
+    /* Band buffer of each plane, destination stride may be negative */
+    for (int i = 0; i < ctx.dst.desc->planes; i++)
+    {
+        linesz[i] = ctx.dst.desc->lineSize (i, ctx.dw);
+        tmp_stride[i] = (linesz[i] + 63) & ~63;
+        tmp_size += (size_t)tmp_stride[i] * -(-dst_h >> ctx.dst.desc->rowShift (i));
+    }
+
+    /* Not thrown, a subtask on a pool thread cannot report it */
+    unique_ptr<uint8_t[]> tmp (new (nothrow) uint8_t[tmp_size]);
+
+    if (!tmp)
+    {
+        failed = true;
+        return;
+    }
+
+    tmp_ptr[0] = tmp.get();
+    for (int i = 1; i < ctx.dst.desc->planes; i++)
+        tmp_ptr[i] = tmp_ptr[i-1] + (size_t)tmp_stride[i-1] * -(-dst_h >> ctx.dst.desc->rowShift (i-1));
+
+    /* Feed in slices of whole units */
+    for (int y = 0; y < src_h && !IsCancelled() && !failed; y += slice)
+    {
+        calcAddr ((uint8_t**)src, ctx.src, b0 * ctx.band.srcRows + y);
+        sws_scale (p.get(), src, ctx.src.stride, y, min (slice, src_h - y), tmp_ptr, tmp_stride);
+    }
+
+    if (IsCancelled() || failed)
+        return;
+
+    ctx.putContext (src_h, dst_h, move (p));
+
+    /* Crop own rows */
+    for (int i = 0; i < ctx.dst.desc->planes; i++)
+    {
+        int shift = ctx.dst.desc->rowShift (i);
+        int y0 = (b0 * ctx.band.dstRows) >> shift;
+        int64_t y1 = end < ctx.band.units ? (end * ctx.band.dstRows) >> shift : -(-(int)ctx.dh >> shift);
+
+        for (int64_t y = (begin * ctx.band.dstRows) >> shift; y < y1; y++)
+        {
+            memcpy (
+                (uint8_t*)ctx.dst.bufs[i] + (ptrdiff_t)ctx.dst.stride[i] * y,
+                tmp_ptr[i] + (size_t)tmp_stride[i] * (y - y0),
+                linesz[i]
+            );
+        }
+    }
+}
+
+
+int Context::scaleBands (ThreadPool &pool)
+{
+    if (!initBands())
+        return scale ((const uint8_t**)src.bufs, src.stride, 0, h, (uint8_t**)dst.bufs, dst.stride);
+
+    atomic<bool> failed (false);
     LoopTaskManager tasks (pool);
-    tasks.SetLoopRange (0, h, 2);
-    tasks.Dispatch<convertTask> (*this);
-    return 0;
+    tasks.SetLoopRange (0, band.units, 1, max (4 * band.haloUnits, MIN_ROWS_PER_TASK / band.srcRows));
+    tasks.SetCancelToken (cancel);
+    tasks.Dispatch<scaleTask> (*this, failed);
+    return tasks.IsCancelled() || failed ? -1 : 0;
 }
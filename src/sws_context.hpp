@@ -9,12 +9,12 @@
 
 extern "C" {
 #include "libavutil/pixfmt.h"
-#include "libavutil/pixdesc.h"
 #include "libswscale/swscale.h"
 }
 
 #include <memory>
 #include <list>
+#include "av_util.hpp"
 #include "threadpool.hpp"
 
 
@@ -25,35 +25,59 @@ typedef std::unique_ptr<struct SwsContext, void(*)(struct SwsContext*)> pSwsCont
 
 /**
  * Wrapper of SwsContext with Multi-Thread capability
+ *
+ * SwsContexts are created on demand and kept while settings are unchanged, so
+ * a Context reused for images of the same size skips their initialization.
  */
 class Context
 {
 private:
-    class convertTask;
+    class scaleTask;
 
-    uint32_t w, h;
+    uint32_t w, h;      ///< Source size
+    uint32_t dw, dh;    ///< Destination size
     uint32_t algo;
 
+    /** Row bands of scaling, see scaleBands() */
+    struct {
+        int srcRows, dstRows;   ///< Rows of a band unit
+        int units;
+        int haloUnits;          ///< Extra units converted on each side of a band
+    } band;
+
     /** Source / destination attributes */
     struct attr {
         void **bufs;
         const int *stride;
         enum AVPixelFormat fmt;
-        const AVPixFmtDescriptor *desc;
-        uint8_t planes;
+        const avutil::PixFmtDesc *desc;
         const int *coeff;
         uint8_t full_rng;
-
-        bool isPLANAR() const;
-        bool isRGB() const;
     } src, dst;
 
     int brightness;
     int contrast;
     int saturation;
 
+    const CancelToken *cancel;
+
+    /** SwsContexts of current settings not in use, kept for later scaling */
+    struct idleContext {
+        int src_h, dst_h;
+        pSwsContext p;
+    };
+    mutable winthread::mutex idleMtx;
+    mutable std::list<idleContext> idle;
+
+    pSwsContext sliceCtx;   ///< Kept between slices of scaleSlice()
+
     static uint32_t quality2algo (int quality);
     static void calcAddr (uint8_t *buf[4], const attr &a, int y);
+    pSwsContext getContext (int src_h, int dst_h) const;
+    void putContext (int src_h, int dst_h, pSwsContext &&p) const;
+    void flushContexts();
+    bool initBands();
+    int scaleBands (ThreadPool &pool);
 
 public:
     enum {
@@ -61,9 +85,29 @@ public:
         QUALITY_MAX = 9
     };
 
+    /** Scaling filter, overrides the one chosen by quality */
+    enum {
+        FILTER_AUTO = -1,
+        FILTER_POINT,
+        FILTER_BILINEAR,
+        FILTER_BICUBIC,
+        FILTER_AREA,
+        FILTER_LANCZOS,
+    };
+
     Context();
 
     void Alloc (int w, int h, enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt, int quality = -1);
+    void Alloc (
+        int w, int h, enum AVPixelFormat src_fmt,
+        int dw, int dh, enum AVPixelFormat dst_fmt,
+        int quality = -1
+    );
+
+    void setFilter (int filter);
+    bool isBanded();
+    int getHalo (bool horizontal = false) const;
+    void setCancelToken (const CancelToken *cancel) { this->cancel = cancel; }
 
     void setColorSpace (
         int src_cs, int src_full_rng,
@@ -80,6 +124,14 @@ public:
         uint8_t *const dst[], const int dstStride[]
     );
 
+    int scaleSlice (
+        const uint8_t *srcSlice[],
+        const int srcStride[],
+        int srcSliceY, int srcSliceH,
+        uint8_t *const dst[], const int dstStride[]
+    );
+
+    /** @return -1 if cancelled, see setCancelToken(), or failed */
     int scaleMT (
         ThreadPool &pool,
         const uint8_t *srcSlice[],
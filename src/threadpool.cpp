@@ -6,6 +6,7 @@
  */
 
 #include <stdlib.h>
+#include <exception>
 
 #include "threadpool.hpp"
 
@@ -14,6 +15,28 @@ using namespace std;
 using namespace winthread;
 
 
+/** Priority of the task running on this thread, -1 if not a worker */
+static __thread int tlsPrio = -1;
+
+
+/** Performance counter in us */
+static int64_t now_us()
+{
+    static LONGLONG freq = 0;
+    LARGE_INTEGER t;
+
+    if (!freq)
+    {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency (&f);
+        freq = f.QuadPart;
+    }
+
+    QueryPerformanceCounter (&t);
+    return t.QuadPart * 1000000 / freq;
+}
+
+
 /**
  * Main procedure of worker thread
  */
@@ -21,20 +44,42 @@ void ThreadPool::threadProc()
 {
     while (1)
     {
-        function<void()> task;
+        item it;
+        int prio;
+        int64_t begin;
 
-        dequeueTask (task);
+        prio = dequeueTask (it);
 
-        if (!task) // Terminate
+        if (!it.task) // Terminate
             break;
 
-        task();
+        begin = now_us();
+        tlsPrio = prio;
+        it.task();
+        tlsPrio = -1;
+
+        {
+            lock_guard _l(taskMtx);
+            stats[prio].runUs += now_us() - begin;
+        }
     }
 }
 
 
+/**
+ * Priority of the running task, to be inherited by its subtasks
+ * Threads outside the pool are considered waiting for the result.
+ */
+int ThreadPool::GetCurrentPriority()
+{
+    return tlsPrio < 0 ? PRIO_INTERACTIVE : tlsPrio;
+}
+
+
 ThreadPool::ThreadPool (uint8_t num): numOfProc(num), bStarted(false)
 {
+    ResetStats();
+
     /* If no number of process specified, get it from system */
     if (numOfProc == AUTO_PROC)
     {
@@ -76,9 +121,9 @@ void ThreadPool::Join()
 
     if (numOfProc > 1)
     {
-        /* Insert terminator task to all threads */
+        /* Insert terminator task to all threads, after all queued tasks */
         for (int i = 0; i < numOfProc; i++)
-            EnqueueTask (term);
+            EnqueueTask (term, PRIO_BACKGROUND);
 
         /* Wait all threads done */
         for (int i = 0; i < numOfProc; i++)
@@ -90,11 +135,14 @@ void ThreadPool::Join()
 }
 
 
-void ThreadPool::EnqueueTask (const function<void()> &task)
+void ThreadPool::EnqueueTask (const function<void()> &task, int prio)
 {
     if (!bStarted)
         Start();
 
+    if (prio < 0 || prio >= PRIO_NUM)
+        prio = PRIO_NORMAL;
+
     if (numOfProc == 1)
     {
         /* Single thread, execute immediately */
@@ -103,25 +151,187 @@ void ThreadPool::EnqueueTask (const function<void()> &task)
     }
     else // Multi-thread
     {
+        item it = {task, now_us()};
+
         lock_guard lck(taskMtx);
-        tasks.push (task);
+        tasks[prio].push (it);
         taskCv.notify_one();
     }
 }
 
 
 /**
- * Wait and dequeue incoming task
+ * Wait and dequeue incoming task of the highest priority
+ * @return Priority of the task
  */
-void ThreadPool::dequeueTask (function<void()> &task)
+int ThreadPool::dequeueTask (item &it)
 {
     lock_guard _l(taskMtx);
+    int prio;
+
+    while (1)
+    {
+        for (prio = 0; prio < PRIO_NUM; prio++)
+        {
+            if (tasks[prio].size() > 0)
+                break;
+        }
+
+        if (prio < PRIO_NUM)
+            break;
 
-    /* Wait if no task available */
-    while (tasks.size() == 0)
+        /* Wait if no task available */
         taskCv.wait (taskMtx);
+    }
 
     /* Dequeue the front task */
-    task = tasks.front();
-    tasks.pop();
+    it = tasks[prio].front();
+    tasks[prio].pop();
+
+    {
+        Stats &st = stats[prio];
+        double wait = now_us() - it.enqueueTime;
+
+        st.count++;
+        st.waitUs += wait;
+        if (st.maxWaitUs < wait)
+            st.maxWaitUs = wait;
+    }
+
+    return prio;
+}
+
+
+ThreadPool::Stats ThreadPool::GetStats (int prio)
+{
+    lock_guard _l(taskMtx);
+    return stats[prio];
+}
+
+
+void ThreadPool::ResetStats()
+{
+    lock_guard _l(taskMtx);
+
+    for (int i = 0; i < PRIO_NUM; i++)
+    {
+        Stats &st = stats[i];
+        st.count = 0;
+        st.waitUs = st.maxWaitUs = st.runUs = 0;
+    }
+}
+
+
+PoolTask::PoolTask (ThreadPool &pool, const function<void()> &fn, int prio):
+    st(make_shared<state>())
+{
+    st->fn = fn;
+    pool.EnqueueTask (bind (&PoolTask::run, st), prio);
+}
+
+
+/**
+ * Run the task if not claimed yet
+ */
+void PoolTask::run (const shared_ptr<state> &st)
+{
+    {
+        lock_guard _l(st->mtx);
+
+        if (st->bClaimed)
+            return;
+
+        st->bClaimed = true;
+    }
+
+    /* Errors shall be handled by the task itself */
+    try {
+        st->fn();
+    }
+    catch (...) {
+    }
+    st->fn = nullptr;
+
+    {
+        lock_guard _l(st->mtx);
+        st->bDone = true;
+    }
+
+    st->done.signal();
+}
+
+
+/**
+ * Wait until task is done, or run it here if not started
+ */
+void PoolTask::Join()
+{
+    if (!st)
+        return;
+
+    run (st);
+    st->done.wait();
+}
+
+
+/**
+ * Wait until task is done, without running it here
+ * @return false if timed out
+ */
+bool PoolTask::WaitFor (DWORD timeout)
+{
+    if (!st)
+        return true;
+
+    return st->done.wait_for (timeout);
+}
+
+
+bool PoolTask::IsDone() const
+{
+    if (!st)
+        return true;
+
+    lock_guard _l(st->mtx);
+    return st->bDone;
+}
+
+
+/**
+ * Run a job on pool while polling on this thread, e.g. host's progress callback
+ * @param poll      Called every interval ms until job is done, returns true to cancel the job
+ * @throw Exception of the job, or #Cancelled if cancelled
+ */
+void RunCancellable (
+    ThreadPool &pool,
+    const function<void()> &fn,
+    CancelToken &cancel,
+    const function<bool()> &poll,
+    DWORD interval
+)
+{
+    exception_ptr err;
+
+    PoolTask task (pool, [&]() {
+        try {
+            fn();
+        }
+        catch (...) {
+            err = current_exception();
+        }
+    });
+
+    while (!task.WaitFor (interval))
+    {
+        if (!cancel.IsCancelled() && poll())
+            cancel.Cancel();
+    }
+
+    task.Join();
+
+    if (cancel.IsCancelled())
+        throw Cancelled();
+
+    if (err)
+        rethrow_exception (err);
 }
@@ -9,26 +9,54 @@
 
 
 #include <stdio.h>
+#include <stdint.h>
 
 #include <queue>
 #include <memory>
+#include <atomic>
+#include <stdexcept>
 
 #include "winthread.hpp"
 
 
 /**
  * WorkerThread management pool
+ *
+ * Tasks are queued per priority; a free worker always takes the highest
+ * priority task first, and tasks of the same priority in FIFO order.
  */
 class ThreadPool
 {
+public:
+    enum Priority {
+        PRIO_INTERACTIVE,   ///< Someone is waiting for it, e.g. image being shown
+        PRIO_NORMAL,
+        PRIO_BACKGROUND,    ///< Prefetch, thumbnails, batch work
+        PRIO_NUM
+    };
+
+    /** Queueing / running time statistics of a priority */
+    struct Stats {
+        uint32_t count;
+        double waitUs;      ///< Total time in queue
+        double maxWaitUs;
+        double runUs;       ///< Total running time
+    };
+
 private:
+    struct item {
+        std::function<void()> task;
+        int64_t enqueueTime;
+    };
+
     uint8_t numOfProc;
     bool bStarted;
     winthread::mutex taskMtx;
     winthread::cond_var taskCv;
-    std::queue<std::function<void()>> tasks;
+    std::queue<item> tasks[PRIO_NUM];
+    Stats stats[PRIO_NUM];
     std::unique_ptr<winthread::thread[]> threads;
-    void dequeueTask (std::function<void()> &task);
+    int dequeueTask (item &it);
     void threadProc();
 
 public:
@@ -39,8 +67,87 @@ public:
     void Join();
 
     uint8_t GetNumOfProc() const { return numOfProc; }
-    void EnqueueTask (const std::function<void()> &task);
+    void EnqueueTask (const std::function<void()> &task, int prio = PRIO_NORMAL);
+
+    Stats GetStats (int prio);
+    void ResetStats();
+
+    static int GetCurrentPriority();
+};
+
+
+/**
+ * A task enqueued to pool, which is run by Join() itself if no worker has
+ * picked it up yet. Joining never deadlocks, even from a worker thread.
+ */
+class PoolTask
+{
+private:
+    struct state {
+        winthread::mutex mtx;
+        winthread::event done;
+        std::function<void()> fn;
+        bool bClaimed;
+        bool bDone;
+
+        state(): done (winthread::event::OPT_MANUAL_RESET), bClaimed(false), bDone(false) {}
+    };
+
+    std::shared_ptr<state> st;
+
+    static void run (const std::shared_ptr<state> &st);
+
+public:
+    PoolTask() {}
+    PoolTask (ThreadPool &pool, const std::function<void()> &fn, int prio = ThreadPool::GetCurrentPriority());
+
+    void Join();
+    bool WaitFor (DWORD timeout);
+    bool IsDone() const;
 };
 
 
+/**
+ * Thrown by work which gave up on cancellation
+ */
+class Cancelled: public std::runtime_error
+{
+public:
+    Cancelled(): std::runtime_error ("cancelled") {}
+};
+
+
+/**
+ * Cooperative cancellation request
+ *
+ * Copies share the same state. Long-running work checks it between rows /
+ * bands and gives up early, so a cancelled job releases the pool quickly.
+ */
+class CancelToken
+{
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+
+public:
+    CancelToken(): flag (std::make_shared<std::atomic<bool>> (false)) {}
+
+    void Cancel() { *flag = true; }
+    bool IsCancelled() const { return *flag; }
+
+    void Check() const {
+        if (IsCancelled())
+            throw Cancelled();
+    }
+};
+
+
+void RunCancellable (
+    ThreadPool &pool,
+    const std::function<void()> &fn,
+    CancelToken &cancel,
+    const std::function<bool()> &poll,
+    DWORD interval
+);
+
+
 #endif /* _THREADPOOL_HPP_ */
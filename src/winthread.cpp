@@ -11,6 +11,11 @@
 using namespace std;
 using namespace winthread;
 
+
+/** Time waiting for a thread to exit after its task returned */
+#define JOIN_EXIT_MS    100
+
+
 handle::~handle()
 {
     CloseHandle (h);
@@ -24,6 +29,15 @@ void handle::wait (DWORD timeout)
 }
 
 
+/**
+ * @return false if timed out
+ */
+bool handle::wait_for (DWORD timeout)
+{
+    return WaitForSingleObject (h, timeout) == WAIT_OBJECT_0;
+}
+
+
 mutex::mutex()
 {
     h = CreateMutexA (NULL, FALSE, NULL);
@@ -129,10 +143,17 @@ void thread::start (function<void()> &task)
 }
 
 
+/**
+ * Wait until the task returns
+ *
+ * Exit of the thread itself is waited for shortly only: it takes the loader
+ * lock, which is held if joined from DllMain(), e.g. on DLL_PROCESS_DETACH.
+ */
 void thread::join()
 {
     beginEv.wait();
-    wait();
+    endEv.wait();
+    wait_for (JOIN_EXIT_MS);
 }
 
 
@@ -144,6 +165,7 @@ unsigned thread::procedure()
         task();
 
     b_joinable = false;
+    endEv.signal();
     return 0;
 }
 
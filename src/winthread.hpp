@@ -31,6 +31,7 @@ public:
     ~handle();
 
     void wait (DWORD timeout = INFINITE);
+    bool wait_for (DWORD timeout);
 };
 
 
@@ -69,6 +70,7 @@ public:
 
     event (int opts = 0);
     void wait() { handle::wait(); }
+    bool wait_for (DWORD timeout) { return handle::wait_for (timeout); }
     void signal();
     void reset();
 };
@@ -99,9 +101,10 @@ private:
     unsigned threadId;
     mutex joinMtx;
     event beginEv;
+    event endEv;            ///< Task returned
 
 public:
-    thread(): b_joinable(false), threadId(0), beginEv(event::OPT_MANUAL_RESET) {}
+    thread(): b_joinable(false), threadId(0), beginEv(event::OPT_MANUAL_RESET), endEv(event::OPT_MANUAL_RESET) {}
 
     virtual ~thread();
 
@@ -17,10 +17,18 @@ extern "C" {
 }
 
 #include "bpg_common.hpp"
+#include "bpg_stream.hpp"
+#include "looptask.hpp"
 #include "log.h"
 
 using namespace std;
 using namespace bpg;
+using namespace winthread;
+
+
+/** Bytes of a band of streamed rows, see Encoder::Begin() */
+#define STREAM_BAND_BYTES       (1 << 20)
+#define MIN_STREAM_BAND_ROWS    16
 
 
 static int get_param (const char buf[], const char s_opt[], const char s_fmt[], ...)
@@ -152,6 +160,8 @@ void EncParam::Parse (const char s_opt[])
 }
 
 
+namespace bpg {
+
 typedef std::unique_ptr<Image, void(*)(Image*)> pImage;
 
 /**
@@ -161,27 +171,60 @@ typedef std::unique_ptr<Image, void(*)(Image*)> pImage;
 class encImage
 {
 private:
+    template <int BPP, int OFS> class planeTask;
+
     pImage img;
     enum AVPixelFormat dst_fmt;
+    uint8_t planes;
 
 public:
-    encImage(): img(nullptr, image_free), dst_fmt(AV_PIX_FMT_NONE) {}
+    /** Planes to be encoded */
+    enum {
+        PLANE_COLOR = 1 << 0,
+        PLANE_ALPHA = 1 << 1,
+        PLANE_ALL   = PLANE_COLOR | PLANE_ALPHA,
+    };
+
+    encImage(): img(nullptr, image_free), dst_fmt(AV_PIX_FMT_NONE), planes(PLANE_ALL) {}
 
     operator bool() const { return !!img; }
     Image* get() { return img.get(); }
 
-    void Alloc (const EncParam &param, const FrameDesc &frame);
-    void Convert (const EncParam &param, const FrameDesc &frame);
+    static bool HasAlpha (enum AVPixelFormat fmt);
+
+    void Alloc (const EncParam &param, const FrameDesc &frame, uint8_t planes = PLANE_ALL);
+    void Convert (const EncParam &param, const FrameDesc &frame, const CancelToken *cancel = NULL, sws::Context *swsCtx = NULL);
+    void ConvertRows (const FrameDesc &band, int y, const CancelToken *cancel, sws::Context &swsCtx);
 };
 
+}
+
 
 
-void encImage::Alloc (const EncParam &param, const FrameDesc &frame)
+bool encImage::HasAlpha (enum AVPixelFormat fmt)
+{
+    switch (fmt)
+    {
+        case AV_PIX_FMT_RGBA:
+        case AV_PIX_FMT_BGRA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+void encImage::Alloc (const EncParam &param, const FrameDesc &frame, uint8_t planes)
 {
     BPGImageFormatEnum fmt2;
     int has_alpha;
 
-    switch (frame.fmt)
+    if (!HasAlpha (frame.fmt))
+        planes = PLANE_COLOR;
+
+    this->planes = planes;
+
+    switch (planes == PLANE_ALPHA ? AV_PIX_FMT_GRAY8 : frame.fmt)
     {
         case AV_PIX_FMT_GRAY8:
             fmt2 = BPG_FORMAT_GRAY;
@@ -203,30 +246,33 @@ void encImage::Alloc (const EncParam &param, const FrameDesc &frame)
         case AV_PIX_FMT_RGBA:
         case AV_PIX_FMT_BGRA:
             fmt2 = param->preferred_chroma_format;
-            switch (fmt2)
+            if (planes == PLANE_COLOR) // Alpha is dropped
             {
-                case BPG_FORMAT_420: dst_fmt = AV_PIX_FMT_YUVA420P16BE; break;
-                case BPG_FORMAT_422: dst_fmt = AV_PIX_FMT_YUVA422P16BE; break;
-                case BPG_FORMAT_444: dst_fmt = AV_PIX_FMT_YUVA444P16BE; break;
-                default: throw runtime_error ("invalid chroma format");
+                switch (fmt2)
+                {
+                    case BPG_FORMAT_420: dst_fmt = AV_PIX_FMT_YUV420P16BE; break;
+                    case BPG_FORMAT_422: dst_fmt = AV_PIX_FMT_YUV422P16BE; break;
+                    case BPG_FORMAT_444: dst_fmt = AV_PIX_FMT_YUV444P16BE; break;
+                    default: throw runtime_error ("invalid chroma format");
+                }
+                has_alpha = 0;
+            }
+            else
+            {
+                switch (fmt2)
+                {
+                    case BPG_FORMAT_420: dst_fmt = AV_PIX_FMT_YUVA420P16BE; break;
+                    case BPG_FORMAT_422: dst_fmt = AV_PIX_FMT_YUVA422P16BE; break;
+                    case BPG_FORMAT_444: dst_fmt = AV_PIX_FMT_YUVA444P16BE; break;
+                    default: throw runtime_error ("invalid chroma format");
+                }
+                has_alpha = 1;
             }
-            has_alpha = 1;
             break;
         default:
             throw runtime_error ("invalid frame format");
     }
 
-    switch (frame.fmt)
-    {
-        case AV_PIX_FMT_RGBA:
-        case AV_PIX_FMT_BGRA:
-            has_alpha = 1;
-            break;
-        default:
-            has_alpha = 0;
-            break;
-    }
-
     img = pImage (
         image_alloc (frame.w, frame.h, fmt2, has_alpha, param.cs, param.BitDepth),
         image_free
@@ -236,12 +282,59 @@ void encImage::Alloc (const EncParam &param, const FrameDesc &frame)
 }
 
 
+/**
+ * Copy a channel of frame into a grayscale plane (16-bit BE),
+ * i.e. luma of GRAY8 frame or alpha of RGBA frame
+ */
+template <int BPP, int OFS>
+class encImage::planeTask: public LoopTask
+{
+private:
+    const FrameDesc &frame;
+    Image &img;
+    int y0;             ///< Image row of the first frame row
+
+public:
+    planeTask (const FrameDesc &frame, Image &img, int y0 = 0): frame(frame), img(img), y0(y0) {}
+
+    virtual void loop (int64_t begin, int64_t end, int64_t step) override {
+        for (int64_t y = begin; y < end && !IsCancelled(); y += step)
+        {
+            const uint8_t *src = (const uint8_t*)frame.ptr + (y - y0) * frame.stride + OFS;
+            uint8_t *dst = img.data[0] + y * img.linesize[0];
+
+            for (uint32_t x = 0; x < frame.w; x++)
+                dst[2*x] = dst[2*x+1] = src[BPP*x];
+        }
+    }
+};
+
+
 /**
  * Convert BPG encoding image (YUV) from Frame
+ * @param swsCtx    Context kept by caller to be reused, or NULL
+ * @throw Cancelled if cancelled
  */
-void encImage::Convert (const EncParam &param, const FrameDesc &frame)
+void encImage::Convert (const EncParam &param, const FrameDesc &frame, const CancelToken *cancel, sws::Context *swsCtx)
 {
-    sws::Context swsCtx;
+    /* Single plane, filled directly */
+    if (planes == PLANE_ALPHA || frame.fmt == AV_PIX_FMT_GRAY8)
+    {
+        LoopTaskManager tasks (*gThreadPool);
+        tasks.SetLoopRange (0, frame.h, 1, MIN_LINES_PER_TASK);
+        tasks.SetCancelToken (cancel);
+
+        if (planes == PLANE_ALPHA)
+            tasks.Dispatch<planeTask<4, 3>> (frame, *img);
+        else
+            tasks.Dispatch<planeTask<1, 0>> (frame, *img);
+
+        if (tasks.IsCancelled())
+            throw Cancelled();
+        return;
+    }
+
+    sws::Context localCtx;
     const uint8_t *src;
     int src_stride;
     uint8_t *dst[4];
@@ -257,9 +350,68 @@ void encImage::Convert (const EncParam &param, const FrameDesc &frame)
         dst_stride[i] = img->linesize[i];
     }
 
-    swsCtx.Alloc (frame.w, frame.h, frame.fmt, dst_fmt, swsCtx.QUALITY_MAX);
-    swsCtx.setColorSpace (SWS_CS_DEFAULT, 1, SWS_CS_DEFAULT, 1);
-    swsCtx.scaleMT (*gThreadPool, &src, &src_stride, 0, frame.h, dst, dst_stride);
+    if (!swsCtx)
+        swsCtx = &localCtx;
+
+    swsCtx->Alloc (frame.w, frame.h, frame.fmt, dst_fmt, sws::Context::QUALITY_MAX);
+    swsCtx->setColorSpace (SWS_CS_DEFAULT, 1, SWS_CS_DEFAULT, 1);
+    swsCtx->setCancelToken (cancel);
+    int ret = swsCtx->scaleMT (*gThreadPool, &src, &src_stride, 0, frame.h, dst, dst_stride);
+
+    if (cancel)
+        cancel->Check();
+
+    if (ret < 0)
+        throw runtime_error ("conversion failed");
+}
+
+
+/**
+ * Convert a band of rows, the image is fed band by band from the top
+ * @param band  Rows [y, y + band.h) of the image
+ * @param swsCtx    Context kept by caller from the first band to the last one
+ * @throw Cancelled if cancelled
+ */
+void encImage::ConvertRows (const FrameDesc &band, int y, const CancelToken *cancel, sws::Context &swsCtx)
+{
+    if (cancel)
+        cancel->Check();
+
+    if (planes == PLANE_ALPHA || band.fmt == AV_PIX_FMT_GRAY8)
+    {
+        LoopTaskManager tasks (*gThreadPool);
+        tasks.SetLoopRange (y, y + band.h, 1, MIN_LINES_PER_TASK);
+        tasks.SetCancelToken (cancel);
+
+        if (planes == PLANE_ALPHA)
+            tasks.Dispatch<planeTask<4, 3>> (band, *img, y);
+        else
+            tasks.Dispatch<planeTask<1, 0>> (band, *img, y);
+
+        if (tasks.IsCancelled())
+            throw Cancelled();
+        return;
+    }
+
+    const uint8_t *src = (const uint8_t*)band.ptr;
+    int src_stride = band.stride;
+    uint8_t *dst[4];
+    int dst_stride[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        dst[i] = img->data[i];
+        dst_stride[i] = img->linesize[i];
+    }
+
+    if (y == 0)
+    {
+        swsCtx.Alloc (img->w, img->h, band.fmt, dst_fmt, sws::Context::QUALITY_MAX);
+        swsCtx.setColorSpace (SWS_CS_DEFAULT, 1, SWS_CS_DEFAULT, 1);
+    }
+
+    if (swsCtx.scaleSlice (&src, &src_stride, y, band.h, dst, dst_stride) < 0)
+        throw runtime_error ("conversion failed");
 }
 
 
@@ -273,7 +425,30 @@ int Encoder::writeFunc (void *opaque, const uint8_t *buf, int buf_len)
 }
 
 
-void Encoder::Encode (FILE *fp, const EncParam &param, const FrameDesc &frame)
+int Encoder::memWriteFunc (void *opaque, const uint8_t *buf, int buf_len)
+{
+    vector<uint8_t> &out = *(vector<uint8_t>*)opaque;
+
+    out.insert (out.end(), buf, buf + buf_len);
+    return buf_len;
+}
+
+
+Encoder::Encoder()
+{
+}
+
+
+Encoder::~Encoder()
+{
+    abort();
+}
+
+
+/**
+ * Encode a converted image
+ */
+void Encoder::encode (const EncParam &param, encImage &img, BPGEncoderWriteFunc *write_func, void *opaque)
 {
     pBPGEncoderContext ctx (
         bpg_encoder_open (param.get()),
@@ -283,11 +458,514 @@ void Encoder::Encode (FILE *fp, const EncParam &param, const FrameDesc &frame)
     if (!ctx)
         throw runtime_error ("Encoder parameter not set");
 
-    encImage img;
-    img.Alloc (param, frame);
-    img.Convert (param, frame);
+    /* x265 itself can not be interrupted */
+    cancel.Check();
 
     Logi ("Encoding...\n");
-    FAIL_THROW (bpg_encoder_encode (ctx.get(), img.get(), writeFunc, fp));
+    FAIL_THROW (bpg_encoder_encode (ctx.get(), img.get(), write_func, opaque));
+}
+
+
+/**
+ * Encode specified planes of a frame
+ */
+void Encoder::encode (
+    const EncParam &param, const FrameDesc &frame, uint8_t planes,
+    BPGEncoderWriteFunc *write_func, void *opaque
+)
+{
+    encImage img;
+    img.Alloc (param, frame, planes);
+    img.Convert (param, frame, &cancel, planes == encImage::PLANE_ALPHA ? NULL : &swsCtx);
+    encode (param, img, write_func, opaque);
+}
+
+
+/**
+ * Encode colour and alpha as separate streams on separate threads,
+ * then mux them into one file
+ */
+void Encoder::encodeSplit (FILE *fp, const EncParam &param, const splitFunc &enc)
+{
+    vector<uint8_t> color, alpha, out;
+    string s_alpha_err;
+    EncParam alphaParam;
+
+    *alphaParam.get() = *param.get();
+    if (param->alpha_qp >= 0)
+        alphaParam->qp = param->alpha_qp;
+
+    PoolTask alphaTask (*gThreadPool, [&]() {
+        try {
+            enc (alphaParam, encImage::PLANE_ALPHA, alpha);
+        }
+        catch (const exception &e) {
+            s_alpha_err = e.what();
+        }
+    });
+
+    try {
+        enc (param, encImage::PLANE_COLOR, color);
+    }
+    catch (...) {
+        alphaTask.Join();
+        throw;
+    }
+
+    alphaTask.Join();
+    cancel.Check();
+    if (!s_alpha_err.empty())
+        throw runtime_error (s_alpha_err);
+
+    BpgStream::MuxAlpha (color, alpha, out);
+    writeFunc (fp, &out[0], out.size());
+}
+
+
+void Encoder::Encode (FILE *fp, const EncParam &param, const FrameDesc &frame)
+{
+    if (encImage::HasAlpha (frame.fmt))
+    {
+        try {
+            encodeSplit (fp, param, [&](const EncParam &p, uint8_t planes, vector<uint8_t> &out) {
+                encode (p, frame, planes, memWriteFunc, &out);
+            });
+            Logi ("Done\n");
+            return;
+        }
+        catch (const Cancelled &e) {
+            throw;
+        }
+        catch (const exception &e) {
+            /* Fall back to sequential encoding by libbpg */
+            Logi ("%s: %s", __FUNCTION__, e.what());
+        }
+    }
+
+    encode (param, frame, encImage::PLANE_ALL, writeFunc, fp);
     Logi ("Done\n");
 }
+
+
+/**
+ * State of an image being streamed
+ */
+struct Encoder::stream
+{
+    FILE *fp;
+    EncParam param;
+    FrameDesc desc;         ///< Format & size of rows, without buffer
+    bool bSplit;            ///< Alpha is encoded as a separate stream
+    encImage color, alpha;
+    Frame bands[2];         ///< Band being filled & band being converted
+    int bandRows;
+    int fill;               ///< Index of band being filled
+    int y0;                 ///< First row of band being filled
+    int y;                  ///< Rows put
+    PoolTask convTask;
+    string sConvErr;
+};
+
+
+/**
+ * Start streaming an image, whose rows are given by PutRows()
+ */
+void Encoder::Begin (FILE *fp, const EncParam &param, int w, int h, enum AVPixelFormat fmt)
+{
+    unique_ptr<stream> s (new stream);
+
+    abort();
+
+    s->fp = fp;
+    *s->param.get() = *param.get();
+    s->desc.SetFormat (w, h, fmt);
+    s->bSplit = encImage::HasAlpha (fmt);
+
+    s->color.Alloc (s->param, s->desc, s->bSplit ? encImage::PLANE_COLOR : encImage::PLANE_ALL);
+    if (s->bSplit)
+        s->alpha.Alloc (s->param, s->desc, encImage::PLANE_ALPHA);
+
+    /* Even rows, so chroma rows are not split by bands */
+    s->bandRows = max (STREAM_BAND_BYTES / (int)s->desc.GetLineSize(), MIN_STREAM_BAND_ROWS) & ~1;
+    s->bandRows = min (s->bandRows, h);
+
+    for (int i = 0; i < 2; i++)
+        s->bands[i].AllocByFormat (w, s->bandRows, fmt);
+
+    s->fill = 0;
+    s->y0 = 0;
+    s->y = 0;
+    strm = move (s);
+}
+
+
+/**
+ * Background conversion task
+ */
+void Encoder::convertBand (int idx, int y, int rows)
+{
+    stream &s = *strm;
+    FrameDesc band = s.bands[idx];
+
+    band.h = rows;
+
+    try {
+        s.color.ConvertRows (band, y, &cancel, swsCtx);
+        if (s.bSplit)
+            s.alpha.ConvertRows (band, y, &cancel, swsCtx);
+    }
+    catch (const exception &e) {
+        s.sConvErr = e.what();
+    }
+}
+
+
+void Encoder::waitConvert()
+{
+    stream &s = *strm;
+
+    s.convTask.Join();
+    s.convTask = PoolTask();
+
+    if (!s.sConvErr.empty())
+    {
+        string s_err;
+        s_err.swap (s.sConvErr);
+        throw runtime_error (s_err);
+    }
+}
+
+
+/**
+ * Convert the filled band in background, next rows go to the other band meanwhile
+ */
+void Encoder::flushBand()
+{
+    stream &s = *strm;
+
+    /* Bands are converted in order, and the other band must be free */
+    waitConvert();
+
+    s.convTask = PoolTask (*gThreadPool, bind (&Encoder::convertBand, this, s.fill, s.y0, s.y - s.y0));
+    s.fill ^= 1;
+    s.y0 = s.y;
+}
+
+
+/**
+ * Drop the image being streamed
+ */
+void Encoder::abort()
+{
+    if (!strm)
+        return;
+
+    strm->convTask.Join();
+    strm.reset();
+}
+
+
+/**
+ * Put rows of the streamed image, in order from the top
+ * @param y     Index of the first row
+ * @param src   Rows of @a stride bytes apart
+ * @throw Cancelled if cancelled
+ */
+void Encoder::PutRows (int y, int rows, const void *src, int stride)
+{
+    if (!strm)
+        throw runtime_error ("Encoding not started");
+
+    stream &s = *strm;
+
+    if (y != s.y || rows < 0 || y + rows > (int)s.desc.h)
+        throw runtime_error ("rows out of order");
+
+    cancel.Check();
+
+    for (int i = 0; i < rows; i++)
+    {
+        s.bands[s.fill].SetLine (s.y - s.y0, (const uint8_t*)src + (ptrdiff_t)stride * i);
+        s.y++;
+
+        if (s.y - s.y0 == s.bandRows || s.y == (int)s.desc.h)
+            flushBand();
+    }
+}
+
+
+/**
+ * Encode the streamed image after all rows are put, and write it to file
+ * @throw Cancelled if cancelled
+ */
+void Encoder::Finish()
+{
+    if (!strm)
+        throw runtime_error ("Encoding not started");
+
+    stream &s = *strm;
+
+    try {
+        waitConvert();
+        cancel.Check();
+
+        if (s.y != (int)s.desc.h)
+            throw runtime_error ("rows missing");
+
+        /* Bands are freed before encoding */
+        for (int i = 0; i < 2; i++)
+            s.bands[i].Free();
+
+        if (s.bSplit)
+        {
+            encodeSplit (s.fp, s.param, [&](const EncParam &p, uint8_t planes, vector<uint8_t> &out) {
+                encode (p, planes == encImage::PLANE_ALPHA ? s.alpha : s.color, memWriteFunc, &out);
+            });
+        }
+        else
+        {
+            encode (s.param, s.color, writeFunc, s.fp);
+        }
+    }
+    catch (...) {
+        abort();
+        throw;
+    }
+
+    abort();
+    Logi ("Done\n");
+}
+
+
+AnimEncoder::AnimEncoder():
+    ctx (nullptr, bpg_encoder_close),
+    fp (NULL),
+    w (0), h (0),
+    frameCnt (0),
+    fps (0)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        imgs[i] = unique_ptr<encImage> (new encImage);
+        durations[i] = 0;
+    }
+}
+
+
+AnimEncoder::~AnimEncoder()
+{
+    convTask.Join();
+}
+
+
+/**
+ * Start an animation
+ * @param loop_count Number of loops, 0 for infinite
+ */
+void AnimEncoder::Begin (FILE *fp, const EncParam &param, int loop_count)
+{
+    *this->param.get() = *param.get();
+
+    /* Frame duration in ms */
+    this->param->animated = 1;
+    this->param->loop_count = loop_count;
+    this->param->frame_delay_num = 1;
+    this->param->frame_delay_den = 1000;
+
+    ctx = pBPGEncoderContext (
+        bpg_encoder_open (this->param.get()),
+        bpg_encoder_close
+    );
+
+    if (!ctx)
+        throw runtime_error ("Encoder parameter not set");
+
+    this->fp = fp;
+    frameCnt = 0;
+    fps = 0;
+    sw.Reset();
+}
+
+
+/**
+ * Background conversion task
+ */
+void AnimEncoder::convert (int idx, const FrameDesc &frame)
+{
+    try {
+        imgs[idx]->Convert (param, frame, &cancel, &swsCtx);
+    }
+    catch (const exception &e) {
+        sConvErr = e.what();
+    }
+}
+
+
+void AnimEncoder::waitConvert()
+{
+    convTask.Join();
+    convTask = PoolTask();
+
+    if (!sConvErr.empty())
+    {
+        string s_err;
+        s_err.swap (sConvErr);
+        throw runtime_error (s_err);
+    }
+}
+
+
+void AnimEncoder::encode (int idx)
+{
+    Logi ("Encoding frame %d...\n", frameCnt - 1);
+    bpg_encoder_set_frame_duration (ctx.get(), durations[idx]);
+    FAIL_THROW (bpg_encoder_encode (ctx.get(), imgs[idx]->get(), Encoder::writeFunc, fp));
+}
+
+
+/**
+ * Add a frame
+ * @param frame     Source frame, which must be kept valid until next AddFrame() / Finish() returns
+ * @param duration  Display duration in ms
+ */
+void AnimEncoder::AddFrame (const FrameDesc &frame, uint32_t duration)
+{
+    int idx = frameCnt & 1;
+
+    if (!ctx)
+        throw runtime_error ("Animation not started");
+
+    cancel.Check();
+
+    /* Previous frame must be ready before its buffer is encoded */
+    waitConvert();
+
+    if (frameCnt == 0)
+    {
+        w = frame.w;
+        h = frame.h;
+    }
+    else if (frame.w != w || frame.h != h)
+        throw runtime_error ("Frame size mismatch");
+
+    /* libbpg pads & converts the encoded image in place, so it is not reusable */
+    imgs[idx]->Alloc (param, frame);
+
+    durations[idx] = duration;
+    convTask = PoolTask (*gThreadPool, bind (&AnimEncoder::convert, this, idx, cref(frame)));
+
+    /* Encode previous frame meanwhile */
+    if (frameCnt > 0)
+        encode (idx ^ 1);
+
+    frameCnt++;
+}
+
+
+/**
+ * Encode the last frame and flush the animation to file
+ */
+void AnimEncoder::Finish()
+{
+    if (!ctx)
+        return;
+
+    waitConvert();
+    cancel.Check();
+
+    if (frameCnt > 0)
+        encode ((frameCnt - 1) & 1);
+
+    FAIL_THROW (bpg_encoder_encode (ctx.get(), NULL, Encoder::writeFunc, fp));
+    ctx.reset();
+
+    double ms = sw.GetMs();
+    if (ms > 0)
+        fps = frameCnt * 1000 / ms;
+
+    Logi ("%d frames, %.2f frames/s\n", frameCnt, fps);
+}
+
+
+EncoderPool::EncoderPool (size_t maxIdle):
+    maxIdle(maxIdle)
+{
+}
+
+
+/**
+ * Parameters, format and size
+ */
+string EncoderPool::makeKey (const EncParam &param, const FrameDesc &frame)
+{
+    string key ((const char*)param.get(), sizeof(*param.get()));
+    uint32_t geo[3] = {frame.w, frame.h, (uint32_t)frame.fmt};
+
+    key.append ((const char*)geo, sizeof(geo));
+    return key;
+}
+
+
+/**
+ * Take an idle encoder of the same key, or a new one
+ */
+unique_ptr<Encoder> EncoderPool::Get (const EncParam &param, const FrameDesc &frame)
+{
+    string key = makeKey (param, frame);
+
+    {
+        lock_guard _l(mtx);
+
+        for (list<slot>::iterator it = idle.begin(); it != idle.end(); ++it)
+        {
+            if (it->key == key)
+            {
+                unique_ptr<Encoder> enc = move (it->enc);
+                idle.erase (it);
+                return enc;
+            }
+        }
+    }
+
+    return unique_ptr<Encoder> (new Encoder);
+}
+
+
+/**
+ * Keep an encoder for later Get() of the same key
+ */
+void EncoderPool::Put (const EncParam &param, const FrameDesc &frame, unique_ptr<Encoder> &&enc)
+{
+    if (!enc)
+        return;
+
+    /* Not cancelled with the save which used it */
+    enc->SetCancelToken (CancelToken());
+
+    lock_guard _l(mtx);
+    slot s;
+
+    s.key = makeKey (param, frame);
+    s.enc = move (enc);
+    idle.push_front (move (s));
+
+    if (idle.size() > maxIdle)
+        idle.pop_back();
+}
+
+
+void EncoderPool::Encode (FILE *fp, const EncParam &param, const FrameDesc &frame, const CancelToken &cancel)
+{
+    unique_ptr<Encoder> enc = Get (param, frame);
+
+    enc->SetCancelToken (cancel);
+    enc->Encode (fp, param, frame);
+    Put (param, frame, move (enc));
+}
+
+
+void EncoderPool::Clear()
+{
+    lock_guard _l(mtx);
+    idle.clear();
+}
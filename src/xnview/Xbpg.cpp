@@ -10,10 +10,10 @@ extern "C" {
 }
 
 #include "log.h"
-#include "av_util.hpp"
 
 #define BPG_COMMON_SET
 #include "bpg_common.hpp"
+#include "prefetcher.hpp"
 
 
 #define ENC_CONFIG_FILE     "Plugins\\Xbpg.ini"
@@ -22,19 +22,54 @@ extern "C" {
 using namespace std;
 
 
+static bpg::Prefetcher *gPrefetcher;
+static bpg::EncoderPool *gEncoderPool;     ///< Batch conversion saves images one by one
+
+
 EXTC BOOL APIENTRY DllMain (HANDLE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
 {
     switch (ul_reason_for_call)
     {
     case DLL_PROCESS_ATTACH :
         Logi ("Compiled at %s %s\n", __TIME__, __DATE__);
+        if (!bpg::IsCpuSupported())
+        {
+            Loge ("CPU does not support instruction set of libbpg\n");
+            return FALSE;
+        }
+
         bpg::gThreadPool = new ThreadPool;
-        avutil::init();
+        bpg::gFramePool = new bpg::FramePool (256 << 20, true);
+        bpg::gDecoderPool = new bpg::DecoderPool;
+
+        /* Read-ahead of folder */
+        {
+            bpg::IniFile f_ini;
+            bpg::Prefetcher::Config cfg;
+            std::string s_opts;
+
+            f_ini.Open (ENC_CONFIG_FILE);
+            f_ini.GetLineByPrefix (s_opts, "prefetch:");
+            cfg.Parse (s_opts.c_str());
+
+            gPrefetcher = new bpg::Prefetcher (*bpg::gThreadPool);
+            gPrefetcher->SetConfig (cfg);
+        }
+
+        gEncoderPool = new bpg::EncoderPool;
         break;
 
     case DLL_PROCESS_DETACH :
-        avutil::deinit();
+        /* Process exit: other threads are terminated, tasks they run never end */
+        if (lpReserved)
+            break;
+
+        delete gEncoderPool;
+        delete gPrefetcher;
+        bpg::gThreadPool->Join();
         delete bpg::gThreadPool;
+        delete bpg::gDecoderPool;
+        delete bpg::gFramePool;
         break;
 
     case DLL_THREAD_ATTACH  :
@@ -81,8 +116,8 @@ EXTC BOOL API gfpGetPluginInfo (
 
 struct BpgReader
 {
-    bpg::Decoder dec;
-    bpg::Frame frame;
+    unique_ptr<bpg::Decoder> dec;
+    unique_ptr<bpg::BandReader> rows;
 };
 
 
@@ -91,11 +126,18 @@ EXTC void *API gfpLoadPictureInit (LPCSTR filename)
 {
     Logi("%s: %s", __FUNCTION__, filename);
     try {
-        BpgReader *r = new BpgReader;
-        bpg::Decoder &dec = r->dec;
+        unique_ptr<BpgReader> r (new BpgReader);
 
-        dec.DecodeFile (filename);
-        return r;
+        r->dec = gPrefetcher->Take (filename);
+        if (!r->dec)
+        {
+            r->dec = bpg::AcquireDecoder();
+            r->dec->DecodeFile (filename);
+        }
+
+        /* Neighbours are decoded while this one is being shown */
+        gPrefetcher->Schedule (filename);
+        return r.release();
     }
     catch (const exception &e) {
         Loge (e.what());
@@ -120,7 +162,7 @@ EXTC BOOL API gfpLoadPictureGetInfo (
 {
     Logi("%s", __FUNCTION__);
     BpgReader *r = (BpgReader*)ptr;
-    bpg::Decoder &dec = r->dec;
+    bpg::Decoder &dec = *r->dec;
     const bpg::ImageInfo &info = dec.GetInfo();
     uint8_t bpp = info.GetBpp();
 
@@ -145,10 +187,10 @@ EXTC BOOL API gfpLoadPictureGetLine (void *ptr, INT line, unsigned char *buffer)
     BpgReader &r = *(BpgReader*)ptr;
 
     try {
-        if (!r.frame)
-            r.dec.ConvertToFrame (r.frame);
+        if (!r.rows)
+            r.rows.reset (new bpg::BandReader (*r.dec));
 
-        r.frame.GetLine (line, buffer);
+        r.rows->GetLine (line, buffer);
     }
     catch (const exception &e) {
         Loge (e.what());
@@ -168,16 +210,23 @@ EXTC void API gfpLoadPictureExit( void * ptr )
 {
     Logi("%s", __FUNCTION__);
     BpgReader *dec = (BpgReader*)ptr;
+
+    dec->rows.reset();
+    bpg::ReleaseDecoder (move (dec->dec));
     delete dec;
 }
 
 
 
+/**
+ * Lines are streamed into the encoder as XnView puts them
+ */
 struct BpgWriter
 {
     bpg::pFILE fp;
     bpg::EncParam param;
-    bpg::Frame frame;
+    bpg::FrameDesc desc;                ///< Format & size only
+    unique_ptr<bpg::Encoder> enc;
 
     BpgWriter(): fp(nullptr, fclose) {}
 };
@@ -193,6 +242,8 @@ EXTC BOOL API gfpSavePictureIsSupported( INT width, INT height, INT bits_per_pix
         return TRUE;
     if (bits_per_pixel == 24)
         return TRUE;
+    if (bits_per_pixel == 32)
+        return TRUE;
 
     return FALSE;
 }
@@ -246,12 +297,15 @@ EXTC void * API gfpSavePictureInit (
             w.param.Parse (s_opts.c_str());
         }
 
-        w.frame.AllocByFormat (width, height, fmt);
+        w.desc.SetFormat (width, height, fmt);
 
         /* Open file to write */
         w.fp = bpg::pFILE (fopen (filename, "wb"), fclose);
         if (!w.fp)
             throw runtime_error (string("Cannot open file ") + filename);
+
+        w.enc = gEncoderPool->Get (w.param, w.desc);
+        w.enc->Begin (w.fp.get(), w.param, width, height, fmt);
     }
     catch (const exception &e) {
         Loge (e.what());
@@ -278,7 +332,7 @@ EXTC BOOL API gfpSavePicturePutLine( void *ptr, INT line, const unsigned char *b
     BpgWriter &w = *(BpgWriter*)ptr;
 
     try {
-        w.frame.SetLine (line, buffer);
+        w.enc->PutRows (line, 1, buffer, w.desc.GetLineSize());
         return TRUE;
     }
     catch (const exception &e) {
@@ -293,8 +347,8 @@ EXTC void API gfpSavePictureExit( void * ptr )
     BpgWriter &w = *pwr;
 
     try {
-        bpg::Encoder enc;
-        enc.Encode (w.fp.get(), w.param, w.frame);
+        w.enc->Finish();
+        gEncoderPool->Put (w.param, w.desc, move (w.enc));
     }
     catch (const exception &e) {
         Loge (e.what());
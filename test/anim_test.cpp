@@ -0,0 +1,183 @@
+/**
+ * @file
+ * Encode animations of odd sizes and decode them back, with and without alpha,
+ * by Decoder and by AnimReader
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <exception>
+#include <vector>
+
+#define BPG_COMMON_SET
+#include "bpg_common.hpp"
+#include "animation.hpp"
+
+using namespace std;
+using namespace bpg;
+
+
+/** Smooth gradients, shifted by frame */
+static void genFrame (Frame &frame, int w, int h, enum AVPixelFormat fmt, int idx)
+{
+    int bpp = Frame::GetBytesPerPixel (fmt);
+
+    frame.AllocByFormat (w, h, fmt);
+
+    for (int y = 0; y < h; y++)
+    {
+        uint8_t *p = (uint8_t*)frame.ptr + (size_t)frame.stride * y;
+
+        for (int x = 0; x < w; x++)
+        {
+            p[x * bpp + 0] = (x * 255 / w + idx * 40) & 0xFF;
+            p[x * bpp + 1] = (y * 255 / h + idx * 40) & 0xFF;
+            p[x * bpp + 2] = ((x + y) * 127 / (w + h) + idx * 20) & 0xFF;
+            if (bpp == 4)
+                p[x * bpp + 3] = 255 - ((y * 200 / h + idx * 10) & 0xFF);
+        }
+    }
+}
+
+
+/** Mean absolute difference per component */
+static double diff (const FrameDesc &a, const FrameDesc &b)
+{
+    int bpp = Frame::GetBytesPerPixel (a.fmt);
+    double sum = 0;
+
+    for (uint32_t y = 0; y < a.h; y++)
+    {
+        const uint8_t *pa = (const uint8_t*)a.ptr + (size_t)a.stride * y;
+        const uint8_t *pb = (const uint8_t*)b.ptr + (size_t)b.stride * y;
+
+        for (uint32_t x = 0; x < a.w * bpp; x++)
+            sum += abs (pa[x] - pb[x]);
+    }
+
+    return sum / ((double)a.w * a.h * bpp);
+}
+
+
+/**
+ * Play the animation by AnimReader: frames in order, then end of animation;
+ * an output format it cannot produce throws instead of ending
+ */
+static bool testReader (const vector<uint8_t> &buf, const Frame frames[], int cnt, enum AVPixelFormat fmt)
+{
+    AnimReader anim (*gThreadPool);
+    const AnimReader::Picture *pic;
+    int n = 0;
+    bool ok = true;
+
+    anim.Open (&buf[0], buf.size(), fmt, -1, AnimReader::LOOP_ONCE);
+
+    while ((pic = anim.GetFrame()))
+    {
+        double d = n < cnt ? diff (frames[n], pic->frame) : 0;
+
+        printf ("%s %ux%u AnimReader frame %d (#%d): diff %.2f\n", pic->idx == n && d < 4 ? "OK      " : "MISMATCH",
+            pic->frame.w, pic->frame.h, n, pic->idx, d);
+        ok &= pic->idx == n && d < 4;
+        n++;
+    }
+
+    if (n != cnt)
+    {
+        printf ("FAIL     AnimReader: %d of %d frame(s)\n", n, cnt);
+        ok = false;
+    }
+
+    anim.Open (&buf[0], buf.size(), AV_PIX_FMT_GRAY16BE, -1, AnimReader::LOOP_ONCE);
+
+    try {
+        anim.GetFrame();
+        printf ("FAIL     AnimReader: error not thrown\n");
+        ok = false;
+    }
+    catch (const exception &e) {
+        printf ("OK       AnimReader error: %s\n", e.what());
+    }
+
+    return ok;
+}
+
+
+static bool test (int w, int h, enum AVPixelFormat fmt)
+{
+    enum { FRAME_CNT = 5 };
+
+    Frame frames[FRAME_CNT];
+    pFILE fp (tmpfile(), fclose);
+    EncParam param;
+    vector<uint8_t> buf;
+    Decoder dec;
+    bool ok = true;
+
+    FAIL_THROW (!fp);
+    param->qp = 12;
+
+    for (int i = 0; i < FRAME_CNT; i++)
+        genFrame (frames[i], w, h, fmt, i);
+
+    {
+        AnimEncoder enc;
+
+        enc.Begin (fp.get(), param);
+        for (int i = 0; i < FRAME_CNT; i++)
+            enc.AddFrame (frames[i], 40);
+        enc.Finish();
+    }
+
+    buf.resize (ftell (fp.get()));
+    rewind (fp.get());
+    FAIL_THROW (fread (&buf[0], 1, buf.size(), fp.get()) != buf.size());
+
+    dec.DecodeBuffer (&buf[0], buf.size());
+
+    for (int i = 0; i < FRAME_CNT; i++)
+    {
+        Frame out;
+        double d;
+
+        if (i > 0 && !dec.NextFrame())
+        {
+            printf ("FAIL     %dx%d bpp %u: %d frame(s) decoded\n", w, h, dec.GetInfo().GetBpp(), i);
+            return false;
+        }
+
+        dec.ConvertToFrame (out);
+        d = diff (frames[i], out);
+        printf ("%s %dx%d bpp %u frame %d: diff %.2f\n", d < 4 ? "OK      " : "MISMATCH", w, h, out.GetBytesPerPixel (out.fmt) * 8, i, d);
+        ok &= d < 4;
+    }
+
+    return testReader (buf, frames, FRAME_CNT, fmt) && ok;
+}
+
+
+int main (void)
+{
+    int fails = 0;
+
+    gThreadPool = new ThreadPool;
+    gThreadPool->Start();
+
+    try {
+        /* Not multiples of CTB size */
+        fails += !test (333, 241, AV_PIX_FMT_RGB24);
+        fails += !test (333, 241, AV_PIX_FMT_RGBA);
+    }
+    catch (const exception &e) {
+        fprintf (stderr, "%s\n", e.what());
+        fails++;
+    }
+
+    printf ("%d failure(s)\n", fails);
+
+    gThreadPool->Join();
+    delete gThreadPool;
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,942 @@
+/**
+ * @file
+ * Decode / convert / encode / thread pool benchmark suite
+ *
+ * Usage: bench [-d dir] [-r repeat] [-s file] [-b file] [-t percent] [-g file] [-G file]
+ *   -d  Load *.bpg corpus from directory instead of generating one
+ *   -r  Repeat count of each measurement (best one is taken)
+ *   -s  Save results as new baseline
+ *   -b  Compare results against baseline
+ *   -t  Regression threshold in percent (default 10)
+ *   -g  Save digests of decoded images, without benchmarking
+ *   -G  Verify decoded images against saved digests, without benchmarking
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <exception>
+
+#include "looptask.hpp"
+#include "pyramid.hpp"
+#include "decode_job.hpp"
+#include "benchmark.hpp"
+
+#define BPG_COMMON_SET
+#include "bpg_common.hpp"
+
+using namespace std;
+using namespace bpg;
+using namespace winthread;
+
+
+/**
+ * A corpus image: BPG bitstream with its RGB source (if available)
+ */
+struct Sample
+{
+    string name;
+    Frame frame;
+    vector<uint8_t> bpg;
+};
+
+
+/**
+ * Ordered benchmark results, in microseconds
+ */
+class Results
+{
+private:
+    vector<pair<string,double>> items;
+
+public:
+    void Add (const string &name, double us) {
+        printf ("%-40s %12.1f us\n", name.c_str(), us);
+        fflush (stdout);
+        items.push_back (make_pair (name, us));
+    }
+
+    void Save (const char s_file[]) const;
+    int Compare (const char s_file[], double threshold) const;
+};
+
+
+static int gRepeat = 3;
+
+
+/**
+ * Run a measurement several times and take the best one
+ */
+template <typename FUNC>
+static double measure (FUNC func)
+{
+    double best = 0;
+
+    for (int i = 0; i < gRepeat; i++)
+    {
+        Stopwatch sw;
+        func();
+        double us = sw.GetUs();
+
+        if (i == 0 || us < best)
+            best = us;
+    }
+
+    return best;
+}
+
+
+/**
+ * Generate a deterministic test pattern:
+ * smooth gradients, hard-edged blocks and low amplitude noise
+ */
+static void genFrame (Frame &frame, int w, int h, enum AVPixelFormat fmt, uint32_t seed)
+{
+    frame.AllocByFormat (w, h, fmt);
+
+    int bpp = frame.GetBytesPerPixel (fmt);
+
+    for (int y = 0; y < h; y++)
+    {
+        uint8_t *p = (uint8_t*)frame.ptr + y * frame.stride;
+
+        for (int x = 0; x < w; x++)
+        {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) & 0xF;
+            int block = (((x >> 6) ^ (y >> 6)) & 1) ? 48 : 0;
+
+            for (int c = 0; c < bpp; c++)
+            {
+                int v;
+
+                if (c == 3) // Alpha, as detailed as colour to stress the alpha stream
+                    v = (x * 255 / w + y * 255 / h) / 2 + (48 - block) + noise * 4;
+                else
+                    v = ((x * (c + 1) + y * (3 - c)) * 255 / (w + h)) / 2 + block + noise;
+
+                p[x * bpp + c] = v > 255 ? 255 : v;
+            }
+        }
+    }
+}
+
+
+/**
+ * Encode frame into memory
+ */
+static void encodeToBuffer (const EncParam &param, const FrameDesc &frame, vector<uint8_t> &buf)
+{
+    pFILE fp (tmpfile(), fclose);
+    FILE *_fp = fp.get();
+
+    if (!_fp)
+        throw runtime_error ("Cannot create temporary file");
+
+    Encoder enc;
+    enc.Encode (_fp, param, frame);
+
+    size_t fsize = ftell (_fp);
+    rewind (_fp);
+
+    buf.resize (fsize);
+    if (fsize != fread (&buf[0], 1, fsize, _fp))
+        throw runtime_error ("Failed to read back encoded image");
+}
+
+
+static void genCorpus (vector<Sample> &corpus)
+{
+    static const struct {
+        const char *name;
+        int w, h;
+        enum AVPixelFormat fmt;
+    } specs[] = {
+        {"vga-rgb",    640,  480,  AV_PIX_FMT_RGB24},
+        {"fhd-rgb",    1920, 1080, AV_PIX_FMT_RGB24},
+        {"12mp-rgb",   4000, 3000, AV_PIX_FMT_RGB24},
+        {"fhd-gray",   1920, 1080, AV_PIX_FMT_GRAY8},
+        {"fhd-rgba",   1920, 1080, AV_PIX_FMT_RGBA},
+        {"12mp-rgba",  4000, 3000, AV_PIX_FMT_RGBA},
+    };
+
+    for (size_t i = 0; i < sizeof(specs)/sizeof(specs[0]); i++)
+    {
+        corpus.push_back (Sample());
+        Sample &s = corpus.back();
+        EncParam param;
+
+        if (specs[i].fmt == AV_PIX_FMT_GRAY8)
+            param->preferred_chroma_format = BPG_FORMAT_GRAY;
+
+        s.name = specs[i].name;
+        genFrame (s.frame, specs[i].w, specs[i].h, specs[i].fmt, i + 1);
+        encodeToBuffer (param, s.frame, s.bpg);
+    }
+}
+
+
+static void loadCorpus (vector<Sample> &corpus, const char s_dir[])
+{
+    WIN32_FIND_DATAA fd;
+    string s_pattern = string(s_dir) + "\\*.bpg";
+    HANDLE h = FindFirstFileA (s_pattern.c_str(), &fd);
+
+    if (h == INVALID_HANDLE_VALUE)
+        throw runtime_error (string("No BPG files in ") + s_dir);
+
+    vector<string> names;
+    do {
+        names.push_back (fd.cFileName);
+    } while (FindNextFileA (h, &fd));
+    FindClose (h);
+
+    /* Fixed order regardless of file system */
+    sort (names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        string s_path = string(s_dir) + "\\" + names[i];
+        pFILE fp (fopen (s_path.c_str(), "rb"), fclose);
+        FILE *_fp = fp.get();
+
+        if (!_fp)
+            throw runtime_error (string("Cannot open file: ") + s_path);
+
+        corpus.push_back (Sample());
+        Sample &s = corpus.back();
+        s.name = names[i];
+
+        fseek (_fp, 0, SEEK_END);
+        size_t fsize = ftell (_fp);
+        fseek (_fp, 0, SEEK_SET);
+
+        s.bpg.resize (fsize);
+        if (fsize != fread (&s.bpg[0], 1, fsize, _fp))
+            throw runtime_error ("Failed to read file");
+
+        /* Source frame for encoding benchmark */
+        Decoder dec;
+        dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+        dec.ConvertToFrame (s.frame);
+    }
+}
+
+
+static void benchDecode (Results &res, const vector<Sample> &corpus)
+{
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        const Sample &s = corpus[i];
+
+        res.Add ("decode/" + s.name, measure ([&]() {
+            Decoder dec;
+            dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+        }));
+
+        ImageInfo hdr;
+        hdr.LoadFromBuffer (&s.bpg[0], s.bpg.size());
+
+        /* libbpg decodes colour & alpha sequentially */
+        if (hdr.has_alpha)
+        {
+            res.Add ("decode-serial/" + s.name, measure ([&]() {
+                Decoder dec;
+                dec.DecodeBuffer (&s.bpg[0], s.bpg.size(), Decoder::OPT_SERIAL);
+            }));
+        }
+
+        /* Sequential decoding of same-sized images, by a reused decoder */
+        {
+            DecoderPool decPool;
+
+            res.Add ("decode-reuse/" + s.name, measure ([&]() {
+                unique_ptr<Decoder> dec = decPool.Get();
+                dec->DecodeBuffer (&s.bpg[0], s.bpg.size());
+                decPool.Put (move (dec));
+            }));
+        }
+    }
+}
+
+
+static void benchConvert (Results &res, const vector<Sample> &corpus)
+{
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        const Sample &s = corpus[i];
+        Decoder dec;
+        Frame frame;
+
+        dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+        dec.ConvertToFrame (frame);
+
+        for (int q = sws::Context::QUALITY_MIN; q <= sws::Context::QUALITY_MAX; q++)
+        {
+            char s_name[64];
+            snprintf (s_name, sizeof(s_name), "convert/q%d/", q);
+
+            res.Add (s_name + s.name, measure ([&]() {
+                dec.Convert (frame.fmt, frame.ptr, frame.stride, q);
+            }));
+        }
+
+        /* Centre quarter, as a zoomed-in viewport */
+        res.Add ("convert/rect/" + s.name, measure ([&]() {
+            int x = frame.w / 4 + 1, y = frame.h / 4 + 1;
+            uint8_t *p = (uint8_t*)frame.ptr + frame.stride * y + Frame::GetBytesPerPixel (frame.fmt) * x;
+            dec.ConvertRect (frame.fmt, p, frame.stride, x, y, frame.w / 2, frame.h / 2);
+        }));
+
+        /* Fit into a third of the size */
+        res.Add ("convert/scale/" + s.name, measure ([&]() {
+            dec.Convert (frame.fmt, frame.ptr, frame.stride, frame.w / 3, frame.h / 3);
+        }));
+
+        /* Row by row, as XnView reads: whole frame, then by bands */
+        {
+            vector<uint8_t> line (frame.GetLineSize());
+
+            res.Add ("convert-rows/frame/" + s.name, measure ([&]() {
+                Frame f;
+                dec.ConvertToFrame (f);
+                for (uint32_t y = 0; y < f.h; y++)
+                    f.GetLine (y, &line[0]);
+            }));
+
+            res.Add ("convert-rows/band/" + s.name, measure ([&]() {
+                BandReader rows (dec);
+                for (uint32_t y = 0; y < frame.h; y++)
+                    rows.GetLine (y, &line[0]);
+            }));
+        }
+
+        /* Banded export to a file, as for images too large for a frame */
+        res.Add ("export/pnm/" + s.name, measure ([&]() {
+            pFILE fp (tmpfile(), fclose);
+            FAIL_THROW (!fp);
+            BandReader (dec).Export (fp.get());
+        }));
+    }
+}
+
+
+static void benchEncode (Results &res, const vector<Sample> &corpus)
+{
+    const Sample &s = corpus[0];
+
+    for (int m = 1; m <= 9; m++)
+    {
+        char s_name[64];
+        EncParam param;
+        vector<uint8_t> buf;
+
+        snprintf (s_name, sizeof(s_name), "encode/m%d/", m);
+        param->compress_level = m;
+
+        res.Add (s_name + s.name, measure ([&]() {
+            encodeToBuffer (param, s.frame, buf);
+        }));
+    }
+
+    /* Line by line, as XnView writes, without a whole frame */
+    {
+        EncParam param;
+
+        res.Add ("encode/stream/" + s.name, measure ([&]() {
+            pFILE fp (tmpfile(), fclose);
+            Encoder enc;
+
+            FAIL_THROW (!fp);
+            enc.Begin (fp.get(), param, s.frame.w, s.frame.h, s.frame.fmt);
+            for (uint32_t y = 0; y < s.frame.h; y++)
+                enc.PutRows (y, 1, (const uint8_t*)s.frame.ptr + (size_t)s.frame.stride * y, s.frame.stride);
+            enc.Finish();
+        }));
+    }
+}
+
+
+/**
+ * Grayscale document: A4 page at 300 dpi
+ */
+static void benchGray (Results &res)
+{
+    static const int W = 2480, H = 3508;
+    Frame page, out;
+    EncParam param;
+    vector<uint8_t> buf;
+    Decoder dec;
+
+    genFrame (page, W, H, AV_PIX_FMT_GRAY8, 7);
+
+    res.Add ("gray/a4/encode", measure ([&]() {
+        encodeToBuffer (param, page, buf);
+    }));
+
+    res.Add ("gray/a4/decode", measure ([&]() {
+        Decoder d;
+        d.DecodeBuffer (&buf[0], buf.size());
+    }));
+
+    dec.DecodeBuffer (&buf[0], buf.size());
+
+    out.AllocByFormat (W, H, AV_PIX_FMT_GRAY8);
+    res.Add ("gray/a4/convert-gray8", measure ([&]() {
+        dec.Convert (out.fmt, out.ptr, out.stride);
+    }));
+
+    out.AllocByFormat (W, H, AV_PIX_FMT_RGB24);
+    res.Add ("gray/a4/convert-rgb24", measure ([&]() {
+        dec.Convert (out.fmt, out.ptr, out.stride);
+    }));
+}
+
+
+/**
+ * Per-image time of encoding many small images: new encoder each vs. encoder pool
+ */
+static void benchSmallEncode (Results &res)
+{
+    enum { IMAGE_CNT = 32, W = 128, H = 96 };
+
+    vector<Frame> frames (IMAGE_CNT);
+    EncParam param;
+    EncoderPool encPool;
+    pFILE fp (tmpfile(), fclose);
+
+    if (!fp)
+        throw runtime_error ("Cannot create temporary file");
+
+    for (int i = 0; i < IMAGE_CNT; i++)
+        genFrame (frames[i], W, H, AV_PIX_FMT_RGB24, i + 1);
+
+    res.Add ("encode/small/new", measure ([&]() {
+        for (int i = 0; i < IMAGE_CNT; i++)
+        {
+            Encoder enc;
+            rewind (fp.get());
+            enc.Encode (fp.get(), param, frames[i]);
+        }
+    }) / IMAGE_CNT);
+
+    res.Add ("encode/small/pool", measure ([&]() {
+        for (int i = 0; i < IMAGE_CNT; i++)
+        {
+            rewind (fp.get());
+            encPool.Encode (fp.get(), param, frames[i]);
+        }
+    }) / IMAGE_CNT);
+}
+
+
+static void benchAnimEncode (Results &res, const vector<Sample> &corpus)
+{
+    enum { FRAME_CNT = 8 };
+
+    const Sample &s = corpus[0];
+    EncParam param;
+    Frame frames[FRAME_CNT];
+
+    for (int i = 0; i < FRAME_CNT; i++)
+        genFrame (frames[i], s.frame.w, s.frame.h, s.frame.fmt, i + 1);
+
+    /* Per-frame time, i.e. 1 / throughput */
+    res.Add ("encode/anim/" + s.name, measure ([&]() {
+        pFILE fp (tmpfile(), fclose);
+        AnimEncoder enc;
+
+        enc.Begin (fp.get(), param);
+        for (int i = 0; i < FRAME_CNT; i++)
+            enc.AddFrame (frames[i], 40);
+        enc.Finish();
+    }) / FRAME_CNT);
+}
+
+
+/**
+ * Decode & convert the whole corpus: one by one vs. all in flight
+ */
+static void benchAsync (Results &res, const vector<Sample> &corpus)
+{
+    res.Add ("decode+convert/seq", measure ([&]() {
+        for (size_t i = 0; i < corpus.size(); i++)
+        {
+            const Sample &s = corpus[i];
+            Decoder dec;
+            Frame frame;
+
+            dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+            dec.ConvertToFrame (frame);
+        }
+    }));
+
+    res.Add ("decode+convert/async", measure ([&]() {
+        vector<pDecodeJob> jobs;
+
+        for (size_t i = 0; i < corpus.size(); i++)
+            jobs.push_back (DecodeAsync (vector<uint8_t> (corpus[i].bpg), DecodeSpec()));
+
+        for (size_t i = 0; i < jobs.size(); i++)
+            jobs[i]->GetFrame();
+    }));
+}
+
+
+/**
+ * Latency of decoding an image while the pool is busy with other decodes:
+ * load in the same class (FIFO) vs. load in background
+ */
+static void benchPriority (Results &res, const vector<Sample> &corpus)
+{
+    const Sample &s = corpus[corpus.size() > 1 ? 1 : 0];
+    const Sample &load = corpus.back();
+    int loadCnt = gThreadPool->GetNumOfProc() * 4;
+    const char *names[2] = {"latency/same-class", "latency/background-load"};
+    int loadPrio[2] = {ThreadPool::PRIO_INTERACTIVE, ThreadPool::PRIO_BACKGROUND};
+
+    for (int k = 0; k < 2; k++)
+    {
+        double best = 0;
+
+        gThreadPool->ResetStats();
+
+        for (int i = 0; i < gRepeat; i++)
+        {
+            vector<pDecodeJob> jobs;
+            DecodeSpec spec;
+            double us;
+
+            spec.priority = loadPrio[k];
+            for (int n = 0; n < loadCnt; n++)
+                jobs.push_back (DecodeAsync (vector<uint8_t> (load.bpg), spec));
+
+            Stopwatch sw;
+            spec.priority = ThreadPool::PRIO_INTERACTIVE;
+            DecodeAsync (vector<uint8_t> (s.bpg), spec)->GetFrame();
+            us = sw.GetUs();
+
+            if (i == 0 || us < best)
+                best = us;
+
+            for (size_t n = 0; n < jobs.size(); n++)
+                jobs[n]->Wait();
+        }
+
+        res.Add (names[k], best);
+        res.Add (string (names[k]) + "/max-wait", gThreadPool->GetStats (ThreadPool::PRIO_INTERACTIVE).maxWaitUs);
+    }
+}
+
+
+/**
+ * Time from cancelling a conversion in flight until the pool is released
+ */
+static void benchCancel (Results &res, const vector<Sample> &corpus)
+{
+    const Sample &s = corpus.back();
+    Decoder dec;
+    Frame frame;
+
+    dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+    frame.AllocByFormat (s.frame.w, s.frame.h, s.frame.fmt);
+
+    double best = 0;
+
+    for (int i = 0; i < gRepeat; i++)
+    {
+        CancelToken cancel;
+        double us;
+
+        dec.SetCancelToken (cancel);
+
+        PoolTask task (*gThreadPool, [&]() {
+            dec.Convert (frame.fmt, frame.ptr, frame.stride);
+        });
+
+        /* Let it run a while */
+        task.WaitFor (5);
+
+        Stopwatch sw;
+        cancel.Cancel();
+        task.Join();
+        us = sw.GetUs();
+
+        if (i == 0 || us < best)
+            best = us;
+    }
+
+    res.Add ("cancel/convert/" + s.name, best);
+    dec.SetCancelToken (CancelToken());
+}
+
+
+/**
+ * Full, 1/2, 1/4, 1/8 and a thumbnail
+ */
+static void benchPyramid (Results &res, const vector<Sample> &corpus)
+{
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        const Sample &s = corpus[i];
+        Decoder dec;
+        Pyramid pyr (*gThreadPool);
+
+        dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+
+        res.Add ("pyramid/" + s.name, measure ([&]() {
+            pyr.Build (dec, s.frame.fmt, 4, 160);
+        }));
+    }
+}
+
+
+/**
+ * Allocate and fill a frame, from system vs. from frame pool
+ */
+static void benchFrames (Results &res, const vector<Sample> &corpus)
+{
+    FramePool *defPool = gFramePool;
+
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        const Sample &s = corpus[i];
+        auto alloc = [&]() {
+            Frame frame;
+            frame.AllocByFormat (s.frame.w, s.frame.h, s.frame.fmt);
+            memset (frame.ptr, 0, frame.stride * frame.h);
+        };
+
+        gFramePool = NULL;
+        res.Add ("frame/sys/" + s.name, measure (alloc));
+
+        gFramePool = defPool;
+        res.Add ("frame/pool/" + s.name, measure (alloc));
+    }
+}
+
+
+/**
+ * Empty loop body, to measure the dispatching overhead
+ */
+class nopTask: public LoopTask
+{
+public:
+    virtual void loop (int64_t begin, int64_t end, int64_t step) override {}
+};
+
+
+static void benchThreads (Results &res, const vector<Sample> &corpus, const vector<int> &threads)
+{
+    enum {
+        TASK_CNT = 10000,
+        DISPATCH_CNT = 1000,
+    };
+
+    ThreadPool *defPool = gThreadPool;
+    const Sample &s = corpus[corpus.size() > 1 ? 1 : 0];
+    Decoder dec;
+    Frame frame;
+
+    dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+    dec.ConvertToFrame (frame);
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        ThreadPool pool (threads[i]);
+        char s_name[64];
+
+        pool.Start();
+
+        /* Raw task enqueue -> execute overhead */
+        snprintf (s_name, sizeof(s_name), "pool/task/t%d", threads[i]);
+        res.Add (s_name, measure ([&]() {
+            mutex mtx;
+            cond_var cv;
+            volatile int pending = TASK_CNT;
+
+            lock_guard _l(mtx);
+
+            for (int n = 0; n < TASK_CNT; n++)
+            {
+                pool.EnqueueTask ([&]() {
+                    lock_guard _l(mtx);
+                    if (--pending == 0)
+                        cv.notify_one();
+                });
+            }
+
+            while (pending > 0)
+                cv.wait (mtx);
+        }) / TASK_CNT);
+
+        /* LoopTaskManager fork-join overhead */
+        snprintf (s_name, sizeof(s_name), "pool/dispatch/t%d", threads[i]);
+        res.Add (s_name, measure ([&]() {
+            for (int n = 0; n < DISPATCH_CNT; n++)
+            {
+                LoopTaskManager tasks (pool);
+                tasks.SetLoopRange (0, 1024);
+                tasks.Dispatch<nopTask>();
+            }
+        }) / DISPATCH_CNT);
+
+        /* Real workload */
+        snprintf (s_name, sizeof(s_name), "convert/t%d/", threads[i]);
+        gThreadPool = &pool;
+        res.Add (s_name + s.name, measure ([&]() {
+            dec.Convert (frame.fmt, frame.ptr, frame.stride);
+        }));
+        gThreadPool = defPool;
+
+        pool.Join();
+    }
+}
+
+
+/**
+ * FNV-1a of decoded image, converted at max quality
+ */
+static uint64_t digestDecode (const Sample &s)
+{
+    Decoder dec;
+    Frame frame;
+    uint64_t hash = 14695981039346656037ULL;
+
+    dec.DecodeBuffer (&s.bpg[0], s.bpg.size());
+    dec.ConvertToFrame (frame, sws::Context::QUALITY_MAX);
+
+    for (uint32_t y = 0; y < frame.h; y++)
+    {
+        const uint8_t *p = (const uint8_t*)frame.ptr + frame.stride * y;
+
+        for (uint32_t x = 0; x < frame.GetLineSize(); x++)
+            hash = (hash ^ p[x]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+static void saveDigests (const vector<Sample> &corpus, const char s_file[])
+{
+    pFILE fp (fopen (s_file, "w"), fclose);
+
+    if (!fp)
+        throw runtime_error (string("Cannot open file: ") + s_file);
+
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        uint64_t hash = digestDecode (corpus[i]);
+
+        printf ("%-40s %016llx\n", corpus[i].name.c_str(), (unsigned long long)hash);
+        fprintf (fp.get(), "%s %016llx\n", corpus[i].name.c_str(), (unsigned long long)hash);
+    }
+}
+
+
+/**
+ * Compare decoded images with digests of another build (e.g. without SIMD)
+ * @return Number of mismatches
+ */
+static int verifyDigests (const vector<Sample> &corpus, const char s_file[])
+{
+    pFILE fp (fopen (s_file, "r"), fclose);
+    map<string,uint64_t> base;
+    char s_name[256];
+    unsigned long long hash;
+    int mismatches = 0;
+
+    if (!fp)
+        throw runtime_error (string("Cannot open file: ") + s_file);
+
+    while (2 == fscanf (fp.get(), "%255s %llx", s_name, &hash))
+        base[s_name] = hash;
+
+    for (size_t i = 0; i < corpus.size(); i++)
+    {
+        map<string,uint64_t>::const_iterator it = base.find (corpus[i].name);
+        uint64_t h = digestDecode (corpus[i]);
+
+        if (it == base.end())
+            printf ("MISSING  %s\n", corpus[i].name.c_str());
+        else if (it->second != h)
+        {
+            printf ("MISMATCH %-40s %016llx -> %016llx\n", corpus[i].name.c_str(),
+                (unsigned long long)it->second, (unsigned long long)h);
+            mismatches++;
+        }
+        else
+            printf ("OK       %s\n", corpus[i].name.c_str());
+    }
+
+    printf ("%d mismatch(es)\n", mismatches);
+    return mismatches;
+}
+
+
+void Results::Save (const char s_file[]) const
+{
+    pFILE fp (fopen (s_file, "w"), fclose);
+
+    if (!fp)
+        throw runtime_error (string("Cannot open file: ") + s_file);
+
+    for (size_t i = 0; i < items.size(); i++)
+        fprintf (fp.get(), "%s %.1f\n", items[i].first.c_str(), items[i].second);
+}
+
+
+/**
+ * Compare with baseline
+ * @return Number of regressions
+ */
+int Results::Compare (const char s_file[], double threshold) const
+{
+    pFILE fp (fopen (s_file, "r"), fclose);
+    map<string,double> base;
+    char s_name[256];
+    double us;
+    int regressions = 0;
+
+    if (!fp)
+        throw runtime_error (string("Cannot open file: ") + s_file);
+
+    while (2 == fscanf (fp.get(), "%255s %lf", s_name, &us))
+        base[s_name] = us;
+
+    printf ("\nCompare with %s (threshold %.1f%%):\n", s_file, threshold);
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        map<string,double>::const_iterator it = base.find (items[i].first);
+        if (it == base.end() || it->second <= 0)
+            continue;
+
+        double diff = (items[i].second - it->second) * 100 / it->second;
+
+        if (diff > threshold)
+        {
+            printf ("REGRESSION %-40s %12.1f -> %12.1f us (%+.1f%%)\n",
+                items[i].first.c_str(), it->second, items[i].second, diff);
+            regressions++;
+        }
+    }
+
+    printf ("%d regression(s)\n", regressions);
+    return regressions;
+}
+
+
+/**
+ * Run all benchmarks
+ * @return 2 if regressed
+ */
+static int runBench (const vector<Sample> &corpus, const char *s_save, const char *s_base, double threshold)
+{
+    Results res;
+
+    /* Thread counts: 1, 2, 4, 8, and number of cores */
+    vector<int> threads;
+    for (int n = 1; n <= 8; n *= 2)
+        threads.push_back (n);
+    if (find (threads.begin(), threads.end(), gThreadPool->GetNumOfProc()) == threads.end())
+        threads.push_back (gThreadPool->GetNumOfProc());
+
+    benchDecode (res, corpus);
+    benchConvert (res, corpus);
+    benchEncode (res, corpus);
+    benchSmallEncode (res);
+    benchGray (res);
+    benchAnimEncode (res, corpus);
+    benchAsync (res, corpus);
+    benchPriority (res, corpus);
+    benchCancel (res, corpus);
+    benchPyramid (res, corpus);
+    benchFrames (res, corpus);
+    benchThreads (res, corpus, threads);
+
+    if (s_save)
+        res.Save (s_save);
+
+    if (s_base && res.Compare (s_base, threshold) > 0)
+        return 2;
+
+    return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+    const char *s_dir = NULL;
+    const char *s_save = NULL;
+    const char *s_base = NULL;
+    const char *s_digest = NULL;
+    const char *s_verify = NULL;
+    double threshold = 10;
+    int ret = 0;
+
+    for (int i = 1; i < argc - 1; i += 2)
+    {
+        if (!strcmp (argv[i], "-d"))
+            s_dir = argv[i+1];
+        else if (!strcmp (argv[i], "-r"))
+            gRepeat = atoi (argv[i+1]);
+        else if (!strcmp (argv[i], "-s"))
+            s_save = argv[i+1];
+        else if (!strcmp (argv[i], "-b"))
+            s_base = argv[i+1];
+        else if (!strcmp (argv[i], "-t"))
+            threshold = atof (argv[i+1]);
+        else if (!strcmp (argv[i], "-g"))
+            s_digest = argv[i+1];
+        else if (!strcmp (argv[i], "-G"))
+            s_verify = argv[i+1];
+    }
+
+    if (gRepeat < 1)
+        gRepeat = 1;
+
+    gThreadPool = new ThreadPool;
+    gThreadPool->Start();
+    gFramePool = new FramePool;
+
+    try {
+        vector<Sample> corpus;
+
+        if (s_dir)
+            loadCorpus (corpus, s_dir);
+        else
+            genCorpus (corpus);
+
+        if (corpus.empty())
+            throw runtime_error ("Empty corpus");
+
+        if (s_digest || s_verify)
+        {
+            if (s_digest)
+                saveDigests (corpus, s_digest);
+            if (s_verify && verifyDigests (corpus, s_verify) > 0)
+                ret = 2;
+        }
+        else
+            ret = runBench (corpus, s_save, s_base, threshold);
+    }
+    catch (const exception &e) {
+        fprintf (stderr, "%s\n", e.what());
+        ret = 1;
+    }
+
+    gThreadPool->Join();
+    delete gThreadPool;
+    delete gFramePool;
+    return ret;
+}
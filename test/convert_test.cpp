@@ -0,0 +1,361 @@
+/**
+ * @file
+ * Compare direct conversion kernels with a floating-point reference, for
+ * every source format, colour matrix and range, of odd and even sizes
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+#include <vector>
+#include <algorithm>
+
+extern "C" {
+#include "libbpg.h"
+}
+
+#include "convert.hpp"
+
+using namespace std;
+
+
+/** Source formats of the kernels */
+static const struct {
+    enum AVPixelFormat fmt;
+    const char *name;
+    int depth;
+    bool be;
+    int cw, ch;     ///< Chroma shifts
+    bool alpha;
+    bool rgb;
+} formats[] = {
+    {AV_PIX_FMT_GBRP16BE,     "gbrp16be",     16, true,  0, 0, false, true},
+    {AV_PIX_FMT_GBRAP16BE,    "gbrap16be",    16, true,  0, 0, true,  true},
+
+    {AV_PIX_FMT_YUV420P16BE,  "yuv420p16be",  16, true,  1, 1, false, false},
+    {AV_PIX_FMT_YUV420P9LE,   "yuv420p9le",    9, false, 1, 1, false, false},
+    {AV_PIX_FMT_YUV420P10LE,  "yuv420p10le",  10, false, 1, 1, false, false},
+    {AV_PIX_FMT_YUV420P12LE,  "yuv420p12le",  12, false, 1, 1, false, false},
+    {AV_PIX_FMT_YUV420P14LE,  "yuv420p14le",  14, false, 1, 1, false, false},
+    {AV_PIX_FMT_YUVA420P16BE, "yuva420p16be", 16, true,  1, 1, true,  false},
+    {AV_PIX_FMT_YUVA420P9LE,  "yuva420p9le",   9, false, 1, 1, true,  false},
+    {AV_PIX_FMT_YUVA420P10LE, "yuva420p10le", 10, false, 1, 1, true,  false},
+
+    {AV_PIX_FMT_YUV422P16BE,  "yuv422p16be",  16, true,  1, 0, false, false},
+    {AV_PIX_FMT_YUV422P9LE,   "yuv422p9le",    9, false, 1, 0, false, false},
+    {AV_PIX_FMT_YUV422P10LE,  "yuv422p10le",  10, false, 1, 0, false, false},
+    {AV_PIX_FMT_YUV422P12LE,  "yuv422p12le",  12, false, 1, 0, false, false},
+    {AV_PIX_FMT_YUV422P14LE,  "yuv422p14le",  14, false, 1, 0, false, false},
+    {AV_PIX_FMT_YUVA422P16BE, "yuva422p16be", 16, true,  1, 0, true,  false},
+    {AV_PIX_FMT_YUVA422P9LE,  "yuva422p9le",   9, false, 1, 0, true,  false},
+    {AV_PIX_FMT_YUVA422P10LE, "yuva422p10le", 10, false, 1, 0, true,  false},
+
+    {AV_PIX_FMT_YUV444P16BE,  "yuv444p16be",  16, true,  0, 0, false, false},
+    {AV_PIX_FMT_YUV444P9LE,   "yuv444p9le",    9, false, 0, 0, false, false},
+    {AV_PIX_FMT_YUV444P10LE,  "yuv444p10le",  10, false, 0, 0, false, false},
+    {AV_PIX_FMT_YUV444P12LE,  "yuv444p12le",  12, false, 0, 0, false, false},
+    {AV_PIX_FMT_YUV444P14LE,  "yuv444p14le",  14, false, 0, 0, false, false},
+    {AV_PIX_FMT_YUVA444P16BE, "yuva444p16be", 16, true,  0, 0, true,  false},
+    {AV_PIX_FMT_YUVA444P9LE,  "yuva444p9le",   9, false, 0, 0, true,  false},
+    {AV_PIX_FMT_YUVA444P10LE, "yuva444p10le", 10, false, 0, 0, true,  false},
+};
+
+static const struct {
+    enum AVPixelFormat fmt;
+    int r, g, b, a;     ///< Byte offsets, a < 0 if none
+    int bytes;
+} dsts[] = {
+    {AV_PIX_FMT_RGB24, 0, 1, 2, -1, 3},
+    {AV_PIX_FMT_BGR24, 2, 1, 0, -1, 3},
+    {AV_PIX_FMT_RGBA,  0, 1, 2,  3, 4},
+    {AV_PIX_FMT_BGRA,  2, 1, 0,  3, 4},
+};
+
+static const struct {
+    int cs;
+    const char *name;
+    double kr, kb;
+} matrices[] = {
+    {BPG_CS_YCbCr,        "bt601",  0.299,  0.114},
+    {BPG_CS_YCbCr_BT709,  "bt709",  0.2126, 0.0722},
+    {BPG_CS_YCbCr_BT2020, "bt2020", 0.2627, 0.0593},
+    {BPG_CS_YCgCo,        "ycgco",  0, 0},
+};
+
+
+/**
+ * A plane of samples, stored as the source format does
+ */
+struct plane
+{
+    int w, h;
+    bool be;
+    vector<uint16_t> v;
+    vector<uint8_t> bytes;
+
+    void init (int w, int h, bool be, int depth, int seed)
+    {
+        uint32_t r = seed * 2654435761u + 1;
+
+        this->w = w;
+        this->h = h;
+        this->be = be;
+        v.resize (w * h);
+        bytes.resize (w * h * 2);
+
+        for (int i = 0; i < w * h; i++)
+        {
+            r = r * 1103515245 + 12345;
+            v[i] = (r >> 8) & ((1 << depth) - 1);
+            bytes[2*i + be]  = v[i] & 0xFF;
+            bytes[2*i + !be] = v[i] >> 8;
+        }
+    }
+
+    /** Sample in 8-bit scale, edges extended */
+    double at (int x, int y, int depth) const
+    {
+        x = min (max (x, 0), w - 1);
+        y = min (max (y, 0), h - 1);
+        return v[y * w + x] / (double)(1 << (depth - 8));
+    }
+};
+
+
+static double clampd (double v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+
+/**
+ * Chroma at luma (x, y), centred between luma samples on subsampled axes
+ */
+static double chroma (const plane &p, int x, int y, int cw, int ch, int depth)
+{
+    int cx = x >> cw, cy = y >> ch;
+    int nx = cw ? cx + ((x & 1) ? 1 : -1) : cx;
+    int ny = ch ? cy + ((y & 1) ? 1 : -1) : cy;
+    double wx = cw ? 0.75 : 1, wy = ch ? 0.75 : 1;
+
+    return wx * wy * p.at (cx, cy, depth) + (1 - wx) * wy * p.at (nx, cy, depth) +
+        wx * (1 - wy) * p.at (cx, ny, depth) + (1 - wx) * (1 - wy) * p.at (nx, ny, depth);
+}
+
+
+/**
+ * Convert in 3 rectangles: top rows, then left & right parts of the rest at
+ * an odd column, and check all pixels of each destination format
+ * @return Number of mismatched pixels
+ */
+static int test (ThreadPool &pool, int fi, int mi, bool limited, int w, int h)
+{
+    const int depth = formats[fi].depth;
+    const int cw = formats[fi].cw, ch = formats[fi].ch;
+    const int cwid = (w + (1 << cw) - 1) >> cw, chei = (h + (1 << ch) - 1) >> ch;
+    const int split_y = h / 3, split_x = 3;
+    plane p[4];
+    conv::Source src;
+    int fails = 0;
+    double maxErr = 0;
+
+    p[0].init (w, h, formats[fi].be, depth, 1);
+    p[1].init (formats[fi].rgb ? w : cwid, formats[fi].rgb ? h : chei, formats[fi].be, depth, 2);
+    p[2].init (formats[fi].rgb ? w : cwid, formats[fi].rgb ? h : chei, formats[fi].be, depth, 3);
+    p[3].init (w, h, formats[fi].be, depth, 4);
+
+    for (int i = 0; i < 4; i++)
+    {
+        src.data[i] = &p[i].bytes[0];
+        src.stride[i] = p[i].w * 2;
+    }
+    if (!formats[fi].alpha)
+        src.data[3] = NULL;
+
+    src.fmt = formats[fi].fmt;
+    src.w = w;
+    src.h = h;
+    src.color_space = formats[fi].rgb ? BPG_CS_RGB : matrices[mi].cs;
+    src.limited_range = limited;
+
+    for (size_t di = 0; di < sizeof(dsts) / sizeof(dsts[0]); di++)
+    {
+        const int bytes = dsts[di].bytes;
+        vector<uint8_t> out ((size_t)w * h * bytes);
+        uint8_t *rect[3] = {
+            &out[0],
+            &out[(size_t)w * bytes * split_y],
+            &out[((size_t)w * split_y + split_x) * bytes],
+        };
+        int ret = 0;
+
+        ret |= conv::Convert (pool, src, dsts[di].fmt, rect[0], w * bytes, 0, 0, w, split_y);
+        ret |= conv::Convert (pool, src, dsts[di].fmt, rect[1], w * bytes, 0, split_y, split_x, h - split_y);
+        ret |= conv::Convert (pool, src, dsts[di].fmt, rect[2], w * bytes, split_x, split_y, w - split_x, h - split_y);
+
+        if (ret < 0)
+        {
+            fails++;
+            continue;
+        }
+
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                const uint8_t *o = &out[((size_t)w * y + x) * bytes];
+                double r, g, b, e;
+
+                if (formats[fi].rgb)
+                {
+                    g = p[0].at (x, y, depth);
+                    b = p[1].at (x, y, depth);
+                    r = p[2].at (x, y, depth);
+
+                    if (limited)
+                    {
+                        r = (r - 16) * 255 / 219;
+                        g = (g - 16) * 255 / 219;
+                        b = (b - 16) * 255 / 219;
+                    }
+                }
+                else
+                {
+                    double yv = p[0].at (x, y, depth);
+                    double u = chroma (p[1], x, y, cw, ch, depth) - 128;
+                    double v = chroma (p[2], x, y, cw, ch, depth) - 128;
+
+                    if (limited)
+                    {
+                        yv = (yv - 16) * 255 / 219;
+                        u *= 255.0 / 224;
+                        v *= 255.0 / 224;
+                    }
+
+                    if (matrices[mi].cs == BPG_CS_YCgCo)
+                    {
+                        r = yv - u + v;
+                        g = yv + u;
+                        b = yv - u - v;
+                    }
+                    else
+                    {
+                        double kr = matrices[mi].kr, kb = matrices[mi].kb, kg = 1 - kr - kb;
+
+                        r = yv + 2 * (1 - kr) * v;
+                        g = yv - 2 * kb * (1 - kb) / kg * u - 2 * kr * (1 - kr) / kg * v;
+                        b = yv + 2 * (1 - kb) * u;
+                    }
+                }
+
+                e = max (max (fabs (clampd (r) - o[dsts[di].r]), fabs (clampd (g) - o[dsts[di].g])),
+                    fabs (clampd (b) - o[dsts[di].b]));
+                maxErr = max (maxErr, e);
+
+                /* Rounding of fixed point, at most 1 */
+                if (e > 1.01)
+                    fails++;
+                else if (dsts[di].a >= 0 &&
+                    o[dsts[di].a] != (formats[fi].alpha ? (int)p[3].at (x, y, depth) : 255))
+                    fails++;
+            }
+        }
+    }
+
+    printf ("%s %-12s %-6s %-7s %dx%d: max. error %.2f\n", fails ? "MISMATCH" : "OK      ",
+        formats[fi].name, formats[fi].rgb ? "rgb" : matrices[mi].name, limited ? "limited" : "full", w, h, maxErr);
+    return fails;
+}
+
+
+/**
+ * Grayscale maps high byte of 16-bit BE samples, in any range
+ */
+static int testGray (ThreadPool &pool, int w, int h)
+{
+    static const enum AVPixelFormat fmts[] = {
+        AV_PIX_FMT_GRAY8, AV_PIX_FMT_RGB24, AV_PIX_FMT_BGR24, AV_PIX_FMT_RGBA, AV_PIX_FMT_BGRA,
+    };
+    plane p;
+    conv::Source src;
+    int fails = 0;
+
+    p.init (w, h, true, 16, 5);
+    src.data[0] = &p.bytes[0];
+    src.stride[0] = w * 2;
+    src.fmt = AV_PIX_FMT_GRAY16BE;
+    src.w = w;
+    src.h = h;
+    src.color_space = BPG_CS_YCbCr;
+    src.limited_range = true;
+
+    for (size_t i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++)
+    {
+        int bytes = fmts[i] == AV_PIX_FMT_GRAY8 ? 1 : (fmts[i] == AV_PIX_FMT_RGB24 || fmts[i] == AV_PIX_FMT_BGR24) ? 3 : 4;
+        vector<uint8_t> out ((size_t)w * h * bytes);
+
+        if (conv::Convert (pool, src, fmts[i], &out[0], w * bytes, 0, 0, w, h) < 0)
+        {
+            fails++;
+            continue;
+        }
+
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                const uint8_t *o = &out[((size_t)w * y + x) * bytes];
+                int v = p.v[y * w + x] >> 8;
+
+                fails += o[0] != v || (bytes >= 3 && (o[1] != v || o[2] != v)) || (bytes == 4 && o[3] != 255);
+            }
+        }
+    }
+
+    printf ("%s gray16be %dx%d\n", fails ? "MISMATCH" : "OK      ", w, h);
+    return fails;
+}
+
+
+int main (void)
+{
+    static const struct {
+        int w, h;
+    } sizes[] = {
+        {37, 23},   // Odd, last chroma sample of a single luma one
+        {36, 22},
+    };
+    int fails = 0;
+
+    ThreadPool pool;
+    pool.Start();
+
+    for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++)
+    {
+        int w = sizes[si].w, h = sizes[si].h;
+
+        for (size_t fi = 0; fi < sizeof(formats) / sizeof(formats[0]); fi++)
+        {
+            for (int limited = 0; limited < 2; limited++)
+            {
+                if (formats[fi].rgb)
+                {
+                    fails += test (pool, fi, 0, limited, w, h) != 0;
+                    continue;
+                }
+
+                for (size_t mi = 0; mi < sizeof(matrices) / sizeof(matrices[0]); mi++)
+                    fails += test (pool, fi, mi, limited, w, h) != 0;
+            }
+        }
+
+        fails += testGray (pool, w, h) != 0;
+    }
+
+    printf ("%d mismatch(es)\n", fails);
+
+    pool.Join();
+    return fails ? 1 : 0;
+}
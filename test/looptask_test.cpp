@@ -31,9 +31,9 @@ public:
 
     virtual ~Task(){}
 
-    virtual void loop (int begin, int end, int step) override {
+    virtual void loop (int64_t begin, int64_t end, int64_t step) override {
 
-        for (int i = begin; i < end; i+=step)
+        for (int64_t i = begin; i < end; i+=step)
         {
             print(i);
             Sleep (1000);
@@ -48,7 +48,8 @@ int main (void)
     ThreadPool pool;
     pool.Start();
 
-    LoopTaskManager set (&pool, -10, 10, 2);
+    LoopTaskManager set (pool);
+    set.SetLoopRange (-10, 10, 2);
     int last = set.Dispatch<Task> (2,3,4);
 
     printf ("last index: %d\n", last);
@@ -5,36 +5,50 @@
  * @author Leav Wu (leavinel@gmail.com)
  */
 
-#include <stdlib.h>
-#include "bpg_common.h"
-#include "benchmark.h"
+#include <stdio.h>
+#include <exception>
+#include "benchmark.hpp"
+
+#define BPG_COMMON_SET
+#include "bpg_common.hpp"
+
+using namespace std;
+using namespace bpg;
 
 
 int main (int argc, char *argv[])
 {
-    BpgReader reader;
-
+    if (argc < 2)
     {
-        Benchmark bm ("decode");
-        reader.LoadFromFile (argv[1]);
+        fprintf (stderr, "Usage: %s <file.bpg>\n", argv[0]);
+        return 1;
     }
 
-    BpgDecoder &decoder = reader.GetDecoder();
-    const BpgImageInfo2 &info = decoder.GetInfo();
-    size_t sz = info.width * info.GetBpp();
-    void *buf = malloc (sz);
+    gThreadPool = new ThreadPool;
 
-    static const int8_t shuffle[] = {0, 1, 2, 3};
+    try {
+        Decoder dec;
+        Frame frame;
+        Stopwatch sw;
 
-    decoder.Start(BPG_OUTPUT_FORMAT_RGB24, shuffle);
+        dec.DecodeFile (argv[1]);
+        printf ("decode: %.3f ms\n", sw.GetMs());
 
-    int h = info.height;
-    {
-        Benchmark bm ("YUV=>RGB");
-        for (int i = 0; i < h; i++)
-            decoder.GetLine (i, buf);
+        const ImageInfo &info = dec.GetInfo();
+        string s_fmt;
+        info.GetFormatDetail (s_fmt);
+        printf ("%ux%u %s\n", info.width, info.height, s_fmt.c_str());
+
+        sw.Reset();
+        dec.ConvertToFrame (frame);
+        printf ("YUV=>RGB: %.3f ms\n", sw.GetMs());
+    }
+    catch (const exception &e) {
+        fprintf (stderr, "%s\n", e.what());
+        return 1;
     }
 
-    free (buf);
+    gThreadPool->Join();
+    delete gThreadPool;
     return 0;
 }
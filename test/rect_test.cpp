@@ -0,0 +1,160 @@
+/**
+ * @file
+ * Convert tiles and odd rectangles by Decoder::ConvertRect(), which must match
+ * the same pixels of the whole frame converted by Decoder::Convert()
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <exception>
+#include <vector>
+#include <algorithm>
+
+#define BPG_COMMON_SET
+#include "bpg_common.hpp"
+
+using namespace std;
+using namespace bpg;
+
+
+/** Gradients with fine details, so any shifted filter tap changes output */
+static void genFrame (Frame &frame, int w, int h)
+{
+    frame.AllocByFormat (w, h, AV_PIX_FMT_RGB24);
+
+    for (int y = 0; y < h; y++)
+    {
+        uint8_t *p = (uint8_t*)frame.ptr + (size_t)frame.stride * y;
+
+        for (int x = 0; x < w; x++)
+        {
+            p[x * 3 + 0] = (x * 255 / w) ^ ((x & 1) * 48);
+            p[x * 3 + 1] = (y * 255 / h) ^ ((y & 1) * 48);
+            p[x * 3 + 2] = ((x + y) * 7) & 0xFF;
+        }
+    }
+}
+
+
+static void encode (const Frame &frame, BPGImageFormatEnum chroma, vector<uint8_t> &buf)
+{
+    pFILE fp (tmpfile(), fclose);
+    EncParam param;
+    Encoder enc;
+
+    FAIL_THROW (!fp);
+    param->qp = 20;
+    param->preferred_chroma_format = chroma;
+
+    enc.Encode (fp.get(), param, frame);
+
+    buf.resize (ftell (fp.get()));
+    rewind (fp.get());
+    FAIL_THROW (fread (&buf[0], 1, buf.size(), fp.get()) != buf.size());
+}
+
+
+/**
+ * Compare rectangles, given by x, y, w, h, against the whole frame
+ * @return number of mismatched rectangles
+ */
+static int testRects (Decoder &dec, enum AVPixelFormat fmt, int quality, const int rects[][4], int cnt)
+{
+    const ImageInfo &info = dec.GetInfo();
+    int bpp = Frame::GetBytesPerPixel (fmt);
+    Frame full;
+    int fails = 0;
+
+    full.AllocByFormat (info.width, info.height, fmt);
+    FAIL_THROW (dec.Convert (fmt, full.ptr, full.stride, quality) < 0);
+
+    for (int i = 0; i < cnt; i++)
+    {
+        int x = rects[i][0], y = rects[i][1];
+        int w = min (rects[i][2], (int)info.width - x);
+        int h = min (rects[i][3], (int)info.height - y);
+        vector<uint8_t> out ((size_t)w * h * bpp);
+        int rows = 0;
+
+        if (dec.ConvertRect (fmt, &out[0], w * bpp, x, y, w, h, quality) < 0)
+        {
+            printf ("FAIL     %ux%u q %d rect %d,%d %dx%d: conversion failed\n", info.width, info.height, quality, x, y, w, h);
+            fails++;
+            continue;
+        }
+
+        for (int j = 0; j < h; j++)
+        {
+            const uint8_t *ref = (const uint8_t*)full.ptr + (size_t)full.stride * (y + j) + bpp * x;
+            rows += memcmp (ref, &out[(size_t)w * bpp * j], w * bpp) != 0;
+        }
+
+        if (rows)
+        {
+            printf ("MISMATCH %ux%u fmt %d q %d rect %d,%d %dx%d: %d row(s)\n", info.width, info.height, fmt, quality, x, y, w, h, rows);
+            fails++;
+        }
+    }
+
+    printf ("%s %ux%u fmt %d q %d: %d rect(s)\n", fails ? "MISMATCH" : "OK      ", info.width, info.height, fmt, quality, cnt);
+    return fails;
+}
+
+
+static int test (int w, int h, BPGImageFormatEnum chroma)
+{
+    static const enum AVPixelFormat fmts[] = {AV_PIX_FMT_BGR24, AV_PIX_FMT_BGRA};
+    static const int qualities[] = {-1, 0, 2, 9};
+
+    const int rects[][4] = {
+        /* 64x64 tiles of the first row & column */
+        {0, 0, 64, 64}, {64, 0, 64, 64}, {128, 0, 64, 64}, {0, 64, 64, 64}, {64, 64, 64, 64},
+        /* Odd positions and sizes, bottom-right corner */
+        {5, 3, 17, 9}, {31, 33, 40, 1}, {1, 1, w - 2, h - 2},
+        {w / 2 + 1, h / 2 + 1, w / 3, h / 3}, {w - 13, h - 7, 13, 7},
+    };
+
+    Frame frame;
+    vector<uint8_t> buf;
+    Decoder dec;
+    int fails = 0;
+
+    genFrame (frame, w, h);
+    encode (frame, chroma, buf);
+    dec.DecodeBuffer (&buf[0], buf.size());
+
+    for (enum AVPixelFormat fmt: fmts)
+        for (int q: qualities)
+            fails += testRects (dec, fmt, q, rects, sizeof(rects) / sizeof(rects[0]));
+
+    return fails;
+}
+
+
+int main (void)
+{
+    int fails = 0;
+
+    gThreadPool = new ThreadPool;
+    gThreadPool->Start();
+
+    try {
+        /* Odd sizes convert whole rows / columns of subsampled chroma */
+        fails += test (256, 128, BPG_FORMAT_420);
+        fails += test (333, 241, BPG_FORMAT_420);
+        fails += test (256, 128, BPG_FORMAT_422);
+        fails += test (333, 241, BPG_FORMAT_444);
+    }
+    catch (const exception &e) {
+        fprintf (stderr, "%s\n", e.what());
+        fails++;
+    }
+
+    printf ("%d failure(s)\n", fails);
+
+    gThreadPool->Join();
+    delete gThreadPool;
+    return fails ? 1 : 0;
+}
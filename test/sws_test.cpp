@@ -0,0 +1,141 @@
+/**
+ * @file
+ * Compare multi-thread / sliced conversion and scaling with single-thread one
+ *
+ * @author Leav Wu (leavinel@gmail.com)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "sws_context.hpp"
+
+using namespace std;
+
+
+/**
+ * 10-bit 4:2:0 planes of gradients and hard edges
+ */
+static void genPlanes (vector<uint16_t> planes[3], int w, int h)
+{
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+
+    planes[0].resize (w * h);
+    planes[1].resize (cw * ch);
+    planes[2].resize (cw * ch);
+
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            planes[0][y * w + x] = ((x * 3 + y * 5) & 1023) ^ (((x / 16 + y / 16) & 1) ? 0x155 : 0);
+
+    for (int y = 0; y < ch; y++)
+    {
+        for (int x = 0; x < cw; x++)
+        {
+            planes[1][y * cw + x] = 512 + ((y / 8) & 1 ? 300 : -300) + x % 64;
+            planes[2][y * cw + x] = (x * 7 + y * 11) & 1023;
+        }
+    }
+}
+
+
+static bool compare (
+    ThreadPool &pool, const vector<uint16_t> planes[3], int w, int h,
+    int dw, int dh, enum AVPixelFormat dst_fmt, int quality, bool banded
+)
+{
+    const uint8_t *src[4] = {
+        (const uint8_t*)&planes[0][0],
+        (const uint8_t*)&planes[1][0],
+        (const uint8_t*)&planes[2][0],
+        NULL
+    };
+    int src_stride[4] = {w * 2, (w + 1) / 2 * 2, (w + 1) / 2 * 2, 0};
+    int bpp = dst_fmt == AV_PIX_FMT_RGBA ? 4 : 3;
+    int dst_stride = dw * bpp;
+    vector<uint8_t> st ((size_t)dst_stride * dh), mt ((size_t)dst_stride * dh), sl ((size_t)dst_stride * dh);
+    uint8_t *dst;
+    sws::Context ctx;
+    bool ok;
+
+    ctx.Alloc (w, h, AV_PIX_FMT_YUV420P10LE, dw, dh, dst_fmt, quality);
+    ctx.setColorSpace (SWS_CS_ITU601, 1, SWS_CS_DEFAULT, 1);
+
+    /* Split by bands, not fallen back to scale() */
+    if (ctx.isBanded() != banded)
+    {
+        printf ("MISMATCH %dx%d -> %dx%d q%d %s\n", w, h, dw, dh, quality, banded ? "not banded" : "banded");
+        return false;
+    }
+
+    dst = &st[0];
+    ctx.scale (src, src_stride, 0, h, &dst, &dst_stride);
+    dst = &mt[0];
+    ctx.scaleMT (pool, src, src_stride, 0, h, &dst, &dst_stride);
+
+    /* Streamed by slices of even rows */
+    dst = &sl[0];
+    for (int y = 0; y < h; y += 38)
+    {
+        const uint8_t *slice[4] = {
+            src[0] + src_stride[0] * y,
+            src[1] + src_stride[1] * (y / 2),
+            src[2] + src_stride[2] * (y / 2),
+            NULL
+        };
+        ctx.scaleSlice (slice, src_stride, y, min (38, h - y), &dst, &dst_stride);
+    }
+
+    ok = st == mt && st == sl;
+    printf ("%s %dx%d -> %dx%d q%d%s\n", ok ? "OK      " : "MISMATCH", w, h, dw, dh, quality, banded ? " banded" : "");
+    return ok;
+}
+
+
+int main (void)
+{
+    static const int W = 333, H = 480;
+    static const struct {
+        int w, h;
+        int dw, dh;
+        bool banded;
+    } sizes[] = {
+        {W, H, W, H, true},                 // Conversion only
+        {W, H, W / 3, H / 3, true},         // Thumbnail
+        {W, H, W * 2, H * 2, true},
+        {W, H, W * 3 / 2, H * 3 / 2, false},    // Rounded vertical step, scaled in one pass
+        {W, 476, W, 476, true},             // Partial last band
+        {W, 477, W, 477, false},            // Odd rows, rounded chroma step
+        {W, 478, W * 2, 956, true},
+        {W, 474, W / 3, 158, true},
+        {W, 20, W, 20, true},               // Small images
+        {W, 10, W, 10, true},
+        {W, 12, W * 2, 24, true},
+        {W, 5, W, 5, false},                // Single unit
+    };
+    int fails = 0;
+
+    ThreadPool pool;
+    pool.Start();
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        vector<uint16_t> planes[3];
+
+        genPlanes (planes, sizes[i].w, sizes[i].h);
+
+        for (int q = sws::Context::QUALITY_MIN; q <= sws::Context::QUALITY_MAX; q++)
+        {
+            fails += !compare (pool, planes, sizes[i].w, sizes[i].h, sizes[i].dw, sizes[i].dh, AV_PIX_FMT_RGB24, q, sizes[i].banded);
+            fails += !compare (pool, planes, sizes[i].w, sizes[i].h, sizes[i].dw, sizes[i].dh, AV_PIX_FMT_RGBA, q, sizes[i].banded);
+        }
+    }
+
+    printf ("%d mismatch(es)\n", fails);
+
+    pool.Join();
+    return fails ? 1 : 0;
+}
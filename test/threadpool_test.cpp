@@ -10,62 +10,48 @@
 #include "threadpool.hpp"
 
 using namespace std;
-//using namespace pthread;
 using namespace winthread;
 
 
-class Task: public task
-{
-public:
-    int const idx;
-    mutex &mtx;
+#define TASK_NUM    10
 
-    Task (int idx, mutex &mtx): idx(idx), mtx(mtx) {
-    }
 
-    virtual ~Task(){}
+static void task (int idx, mutex &mtx)
+{
+    {
+        lock_guard _l(mtx);
+        printf ("task %u start\n", idx);
+    }
 
-    virtual void run() override {
+    for (int i = 0; i < 3; i++)
+    {
+        Sleep(1000);
         {
             lock_guard _l(mtx);
-            printf ("task %u start\n", idx);
-        }
-
-        for (int i = 0; i < 3; i++)
-        {
-            Sleep(1000);
-            {
-                lock_guard _l(mtx);
-                printf ("task %u sleep %u\n", idx, i);
-            }
+            printf ("task %u sleep %u\n", idx, i);
         }
+    }
 
-        {
-            lock_guard _l(mtx);
-            printf ("task %u finish\n", idx);
-        }
+    {
+        lock_guard _l(mtx);
+        printf ("task %u finish\n", idx);
     }
-};
+}
 
-#define TASK_NUM    10
 
 int main()
 {
     ThreadPool pool(4);
-    Task *tasks[TASK_NUM];
     mutex mtx;
-#if 1
-    for (int i = 0; i < TASK_NUM; i++)
-        tasks[i] = new Task (i, mtx);
 
-    for (int i = 0; i < TASK_NUM; i++)
-        pool.EnqueueTask (tasks[i]);
-#endif
     pool.Start();
+
+    for (int i = 0; i < TASK_NUM; i++)
+        pool.EnqueueTask (bind (task, i, ref(mtx)));
+
     puts ("Waiting ThreadPool...");
     pool.Join();
     puts ("ThreadPool done");
 
     return 0;
 }
-